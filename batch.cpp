@@ -0,0 +1,217 @@
+// $Id: batch.cpp,v 1.1 2026-10-16 09:12:40-07 - - $
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "batch.h"
+#include "commands.h"
+#include "debug.h"
+#include "output.h"
+
+/*** BATCH QUEUE ***/
+batch_queue::batch_queue (size_t capacity): ring (capacity) {
+   if (pipe2 (wake, O_CLOEXEC) != 0) wake[0] = wake[1] = -1;
+}
+
+batch_queue::~batch_queue() {
+   if (wake[0] >= 0) ::close (wake[0]);
+   if (wake[1] >= 0) ::close (wake[1]);
+}
+
+bool batch_queue::push (batch_chunk&& chunk) {
+   unique_lock<mutex> guard (lock);
+   not_full.wait (guard, [this] {
+      return consumer_done or count < ring.size();
+   });
+   if (consumer_done) return false;
+   ring[(head + count) % ring.size()] = move (chunk);
+   ++count;
+   not_empty.notify_one();
+   return true;
+}
+
+bool batch_queue::pop (batch_chunk& chunk) {
+   unique_lock<mutex> guard (lock);
+   not_empty.wait (guard, [this] {
+      return producer_done or count > 0;
+   });
+   if (count == 0) return false;
+   chunk = move (ring[head]);
+   head = (head + 1) % ring.size();
+   --count;
+   not_full.notify_one();
+   return true;
+}
+
+// Called by the producer after its last push.
+void batch_queue::finish() {
+   lock_guard<mutex> guard (lock);
+   producer_done = true;
+   not_empty.notify_one();
+}
+
+// Called by the consumer when it will not pop any more.
+void batch_queue::close() {
+   lock_guard<mutex> guard (lock);
+   consumer_done = true;
+   not_full.notify_one();
+   if (wake[1] >= 0) {
+      char byte = 0;
+      while (write (wake[1], &byte, 1) < 0 and errno == EINTR) {}
+   }
+}
+
+/*** READER THREAD ***/
+// Lines are handed over this many at a time so the lock in the
+// queue is taken once per chunk rather than once per line.
+static constexpr size_t CHUNK_LINES {256};
+
+// Copies a block of text into chunks of lines, splits the lines into
+// words, and queues the chunks.  Returns the number of bytes used,
+// leaving any unterminated last line unless at_eof is set.  Returns
+// npos if the consumer has gone away.
+static size_t queue_lines (const char* text, size_t size, bool at_eof,
+                           batch_queue& queue, tokenizer& words) {
+   size_t used = 0;
+   while (used < size) {
+      size_t end = used;
+      size_t lines = 0;
+      while (end < size and lines < CHUNK_LINES) {
+         const char* newline = static_cast<const char*> (
+                               memchr (text + end, '\n', size - end));
+         if (newline == nullptr) {
+            if (at_eof) {
+               end = size;
+               ++lines;
+            }
+            break;
+         }
+         end = newline - text + 1;
+         ++lines;
+      }
+      if (lines == 0) break;
+
+      batch_chunk chunk;
+      chunk.text.assign (text + used, text + end);
+      chunk.lines.reserve (lines);
+      string_view block (chunk.text.data(), chunk.text.size());
+      for (size_t pos = 0; pos < block.size();) {
+         size_t newline = block.find ('\n', pos);
+         size_t length = (newline == string_view::npos ? block.size()
+                                                       : newline) - pos;
+         string_view line = block.substr (pos, length);
+         wordspan line_words = words.split (line);
+         chunk.lines.push_back ({line, chunk.words.size(),
+                                 line_words.size()});
+         chunk.words.insert (chunk.words.end(), line_words.begin(),
+                             line_words.end());
+         pos += length + 1;
+      }
+      if (not queue.push (move (chunk))) return string::npos;
+      used = end;
+   }
+   return used;
+}
+
+// Waits until fd can be read or the queue is closed, and returns
+// false if the queue was closed, so that an exit is not held up by a
+// read from a pipe or terminal that has nothing more to say.
+static bool wait_readable (int fd, const batch_queue& queue) {
+   pollfd fds[2] {{fd, POLLIN, 0}, {queue.wake_fd(), POLLIN, 0}};
+   for (;;) {
+      if (poll (fds, 2, -1) >= 0) return fds[1].revents == 0;
+      if (errno != EINTR) return true;
+   }
+}
+
+// Maps the script if it is a regular file, and otherwise reads it
+// in large blocks.
+static void read_script (int fd, batch_queue& queue) {
+   tokenizer words;
+   struct stat info;
+   if (fstat (fd, &info) == 0 and S_ISREG (info.st_mode)
+       and info.st_size > 0) {
+      size_t size = info.st_size;
+      void* map = mmap (nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+         madvise (map, size, MADV_SEQUENTIAL);
+         queue_lines (static_cast<const char*> (map), size, true,
+                      queue, words);
+         munmap (map, size);
+         queue.finish();
+         return;
+      }
+   }
+
+   constexpr size_t BLOCK_SIZE {1 << 16};
+   string pending;
+   vector<char> block (BLOCK_SIZE);
+   for (;;) {
+      if (not wait_readable (fd, queue)) break;
+      ssize_t got = read (fd, block.data(), block.size());
+      if (got < 0 and errno == EINTR) continue;
+      bool at_eof = got <= 0;
+      if (not at_eof) pending.append (block.data(), got);
+      size_t used = queue_lines (pending.data(), pending.size(),
+                                 at_eof, queue, words);
+      if (used == string::npos or at_eof) break;
+      pending.erase (0, used);
+   }
+   queue.finish();
+}
+
+/*** COMMAND LOOP ***/
+void run_batch (inode_state& state, int fd, bool need_echo) {
+   constexpr size_t QUEUE_CHUNKS {64};
+   batch_queue queue (QUEUE_CHUNKS);
+   thread reader (read_script, fd, ref (queue));
+
+   output_buffer output (cout, STDOUT_FILENO,
+                         flush_policy::AT_THRESHOLD);
+   auto finish = [&] {
+      queue.close();
+      reader.join();
+   };
+
+   try {
+      batch_chunk chunk;
+      while (queue.pop (chunk)) {
+         for (const batch_line& line: chunk.lines) {
+            try {
+               wordspan words = chunk.words_of (line);
+               cout << state.prompt();
+               if (need_echo) cout << line.line << '\n';
+               DEBUGF ('y', "words = " << words);
+               if (words.size() > 0 and words.at(0).at(0) != '#') {
+                  run_command (state, words);
+               }
+            }catch (command_error& error) {
+               // Keep errors in order with the buffered output.
+               output.drain();
+               complain() << error.what() << endl;
+            }catch (file_error& error) {
+               output.drain();
+               complain() << error.what() << endl;
+            }
+         }
+      }
+      cout << state.prompt();
+      if (need_echo) cout << "^D";
+      cout << endl;
+      DEBUGF ('y', "EOF");
+   }catch (...) {
+      finish();
+      throw;
+   }
+   finish();
+}
+
@@ -0,0 +1,86 @@
+// $Id: batch.h,v 1.1 2026-10-16 09:12:40-07 - - $
+
+// batch -
+//    Runs a whole script through the command loop without the
+//    per-line overhead of the interactive loop in main.  A reader
+//    thread bulk reads the script, splits it into lines and words,
+//    and hands them over in chunks through a bounded ring buffer,
+//    while the calling thread executes them with cout buffered.
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "file_sys.h"
+#include "util.h"
+
+// batch_line -
+//    One line of the script, kept whole for echoing, along with the
+//    range of the chunk's words that it splits into.
+// batch_chunk -
+//    A run of lines of the script copied into one buffer, with the
+//    words of every line as string_views into that buffer.  Moving a
+//    chunk does not move its buffer, so the views stay valid.
+
+struct batch_line {
+   string_view line;
+   size_t first_word;
+   size_t word_count;
+};
+
+struct batch_chunk {
+   vector<char> text;
+   vector<string_view> words;
+   vector<batch_line> lines;
+   wordspan words_of (const batch_line& line) const {
+      return wordspan (words.data() + line.first_word, line.word_count);
+   }
+};
+
+// batch_queue -
+//    A bounded ring of chunks between one producer and one consumer.
+//    push blocks while the ring is full and returns false once the
+//    consumer has closed the queue.  pop blocks while it is empty and
+//    returns false when the producer has finished and all is drained.
+//    Closing the queue also makes wake_fd readable, so a producer
+//    waiting on its input in poll can stop without reading more.
+
+class batch_queue {
+   private:
+      vector<batch_chunk> ring;
+      size_t head {0};
+      size_t count {0};
+      bool producer_done {false};
+      bool consumer_done {false};
+      mutex lock;
+      condition_variable not_empty;
+      condition_variable not_full;
+      int wake[2] {-1, -1};
+   public:
+      explicit batch_queue (size_t capacity);
+      ~batch_queue();
+      batch_queue (const batch_queue&) = delete;
+      batch_queue& operator= (const batch_queue&) = delete;
+      int wake_fd() const { return wake[0]; }
+      bool push (batch_chunk&& chunk);
+      bool pop (batch_chunk& chunk);
+      void finish();
+      void close();
+};
+
+// run_batch -
+//    Reads the script from fd and executes it against the state,
+//    echoing each line after the prompt if need_echo is set, as the
+//    interactive loop does when want_echo says so.  Returns at end
+//    of file; ysh_exit propagates to the caller after the reader
+//    thread is stopped and the output drained.
+
+void run_batch (inode_state& state, int fd, bool need_echo);
+
+#endif
+
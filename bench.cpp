@@ -0,0 +1,302 @@
+// $Id: bench.cpp,v 1.1 2026-10-16 11:20:05-07 - - $
+
+// bench -
+//    Micro and macro benchmarks for yshell.  Each benchmark prints
+//    one line of JSON to cout giving its name, the number of
+//    operations, the mean time and number of heap allocations per
+//    operation, and the peak resident set size of the process so far.
+//    Usage:  ybench [-n scale] [name ...]
+//    Only benchmarks whose names contain one of the given names are
+//    run.  The scale multiplies the operation counts.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "commands.h"
+#include "file_sys.h"
+#include "stats.h"
+#include "util.h"
+
+// null_output -
+//    A streambuf that throws away everything, so that benchmarks of
+//    printing commands measure formatting and not the terminal.
+
+class null_output: public streambuf {
+   protected:
+      virtual int_type overflow (int_type ch) override {
+         return traits_type::not_eof (ch);
+      }
+      virtual streamsize xsputn (const char*, streamsize size)
+                                override {
+         return size;
+      }
+};
+
+static null_output null_buffer;
+static ostream null_stream (&null_buffer);
+
+static size_t scale {1};
+static wordvec selected;
+
+static long peak_rss_kb() {
+   struct rusage usage;
+   getrusage (RUSAGE_SELF, &usage);
+   return usage.ru_maxrss;
+}
+
+// run -
+//    Runs setup untimed, then body, which must perform ops operations,
+//    and prints the result.  Each benchmark starts with an empty
+//    filesystem.
+
+template <typename setup_fn, typename body_fn>
+void run (const string& name, size_t ops, setup_fn setup, body_fn body) {
+   if (not selected.empty()) {
+      bool wanted = false;
+      for (const string& pattern: selected) {
+         if (name.find (pattern) != string::npos) wanted = true;
+      }
+      if (not wanted) return;
+   }
+   inode_table::clear();
+   inode_state state;
+   setup (state);
+   size_t allocations = stats::allocations();
+   auto start = chrono::steady_clock::now();
+   body (state);
+   auto stop = chrono::steady_clock::now();
+   allocations = stats::allocations() - allocations;
+   double nanoseconds = chrono::duration<double, nano> (stop - start)
+                        .count();
+   cout << "{\"bench\":\"" << name << "\",\"ops\":" << ops
+        << ",\"ns_per_op\":" << nanoseconds / ops
+        << ",\"allocs_per_op\":"
+        << static_cast<double> (allocations) / ops
+        << ",\"peak_rss_kb\":" << peak_rss_kb() << "}" << endl;
+}
+
+static void no_setup (inode_state&) {
+}
+
+// Runs script lines through the command table as main would, with
+// cout thrown away.
+static void run_script (inode_state& state, const wordvec& lines) {
+   streambuf* saved = cout.rdbuf (&null_buffer);
+   tokenizer line_tokenizer;
+   for (const string& line: lines) {
+      wordspan words = line_tokenizer.split (line);
+      if (words.empty()) continue;
+      try {
+         run_command (state, words);
+      }catch (command_error&) {
+      }catch (file_error&) {
+      }
+   }
+   cout.rdbuf (saved);
+}
+
+static string deep_path (size_t depth) {
+   string path;
+   for (size_t level = 0; level < depth; ++level) {
+      path += "/d" + to_string (level);
+   }
+   return path;
+}
+
+static void make_deep (inode_state& state, size_t depth) {
+   inode_ptr dir = state.get_root();
+   for (size_t level = 0; level < depth; ++level) {
+      dir = dir->make_dir ("d" + to_string (level));
+   }
+}
+
+static void micro_benchmarks() {
+   size_t ops = 200000 * scale;
+   run ("split_command", ops, no_setup, [ops] (inode_state&) {
+      const string line {"make /usr/local/share/doc some words here"};
+      for (size_t op = 0; op < ops; ++op) split (line, " \t");
+   });
+   run ("split_path", ops, no_setup, [ops] (inode_state&) {
+      const string path {"/usr/local/share/doc/yshell/README"};
+      for (size_t op = 0; op < ops; ++op) split (path, "/");
+   });
+   run ("tokenize_command", ops, no_setup, [ops] (inode_state&) {
+      const string line {"make /usr/local/share/doc some words here"};
+      tokenizer words;
+      for (size_t op = 0; op < ops; ++op) words.split (line);
+   });
+   run ("tokenize_path", ops, no_setup, [ops] (inode_state&) {
+      const string path {"/usr/local/share/doc/yshell/README"};
+      tokenizer components;
+      for (size_t op = 0; op < ops; ++op) components.split (path, SLASH);
+   });
+   run ("find_command_fn", ops, no_setup, [ops] (inode_state&) {
+      const string_view names[] {"cat", "mkdir", "prompt", "rmr"};
+      for (size_t op = 0; op < ops; ++op) {
+         find_command_fn (names[op % size (names)]);
+      }
+   });
+   run ("check_validity_deep", ops,
+        [] (inode_state& state) { make_deep (state, 32); },
+        [ops] (inode_state& state) {
+      const string path = deep_path (32);
+      for (size_t op = 0; op < ops; ++op) check_validity (state, path);
+   });
+   run ("check_validity_miss", ops,
+        [] (inode_state& state) { make_deep (state, 32); },
+        [ops] (inode_state& state) {
+      const string path = deep_path (31) + "/missing";
+      for (size_t op = 0; op < ops; ++op) {
+         try {
+            check_validity (state, path);
+         }catch (command_error&) {
+         }
+      }
+   });
+
+   run ("pwd_deep", ops,
+        [] (inode_state& state) {
+      make_deep (state, 256);
+      state.set_directory (check_validity (state, deep_path (256)));
+   }, [ops] (inode_state& state) {
+      const string_view words[] {"pwd"};
+      streambuf* saved = cout.rdbuf (&null_buffer);
+      for (size_t op = 0; op < ops; ++op) {
+         fn_pwd (state, wordspan (words, 1));
+      }
+      cout.rdbuf (saved);
+   });
+
+   size_t entries = 100000 * scale;
+   wordvec names;
+   for (size_t entry = 0; entry < entries; ++entry) {
+      names.push_back ("entry" + to_string (entry));
+   }
+   run ("directory_mkfile", entries, no_setup,
+        [&names] (inode_state& state) {
+      inode_ptr root = state.get_root();
+      for (const string& name: names) root->make_file (name);
+   });
+   run ("directory_mkdir", entries, no_setup,
+        [&names] (inode_state& state) {
+      inode_ptr root = state.get_root();
+      for (const string& name: names) root->make_dir (name);
+   });
+   run ("directory_remove", entries,
+        [&names] (inode_state& state) {
+      inode_ptr root = state.get_root();
+      for (const string& name: names) root->make_file (name);
+   }, [&names] (inode_state& state) {
+      inode_ptr root = state.get_root();
+      for (const string& name: names) root->remove (name);
+   });
+
+   run ("plain_file_writefile", ops,
+        [] (inode_state& state) {
+      state.get_root()->make_file ("file");
+   }, [ops] (inode_state& state) {
+      inode_ptr file = state.get_root()->lookup ("file");
+      string text;
+      for (size_t word = 0; word < 64; ++word) text += "word ";
+      text.pop_back();
+      for (size_t op = 0; op < ops; ++op) {
+         string copy = text;
+         file->writefile (move (copy));
+      }
+   });
+
+   size_t listings = 200 * scale;
+   run ("directory_print", listings,
+        [] (inode_state& state) {
+      inode_ptr root = state.get_root();
+      for (size_t entry = 0; entry < 1000; ++entry) {
+         root->make_file ("entry" + to_string (entry));
+      }
+   }, [listings] (inode_state& state) {
+      inode& root = *state.get_root();
+      for (size_t op = 0; op < listings; ++op) null_stream << root;
+   });
+}
+
+static void macro_benchmarks() {
+   // A chain of directories, with a few files at every level, then
+   // cat and ls of everything by absolute path.
+   wordvec deep;
+   size_t depth = 200 * scale;
+   string path;
+   for (size_t level = 0; level < depth; ++level) {
+      path += "/d" + to_string (level);
+      deep.push_back ("mkdir " + path);
+      for (size_t file = 0; file < 4; ++file) {
+         deep.push_back ("make " + path + "/f" + to_string (file)
+                         + " some words in a file");
+      }
+   }
+   path.clear();
+   for (size_t level = 0; level < depth; ++level) {
+      path += "/d" + to_string (level);
+      deep.push_back ("cat " + path + "/f0 " + path + "/f3");
+      deep.push_back ("ls " + path);
+   }
+   deep.push_back ("lsr /");
+   run ("script_deep_tree", deep.size(), no_setup,
+        [&deep] (inode_state& state) { run_script (state, deep); });
+
+   // Many files in one directory, then probing and removing them.
+   wordvec wide;
+   size_t files = 50000 * scale;
+   wide.push_back ("mkdir /wide");
+   for (size_t file = 0; file < files; ++file) {
+      wide.push_back ("make /wide/file" + to_string (file) + " x y z");
+   }
+   wide.push_back ("ls /wide");
+   for (size_t file = 0; file < files; file += 2) {
+      wide.push_back ("rm /wide/file" + to_string (file));
+   }
+   wide.push_back ("rmr /wide");
+   run ("script_wide_dir", wide.size(), no_setup,
+        [&wide] (inode_state& state) { run_script (state, wide); });
+
+   // A few large files written and read back repeatedly.
+   wordvec big;
+   string words;
+   for (size_t word = 0; word < 10000; ++word) {
+      words += " w" + to_string (word);
+   }
+   for (size_t round = 0; round < 50 * scale; ++round) {
+      string name = "big" + to_string (round % 8);
+      big.push_back ("make " + name + words);
+      big.push_back ("cat " + name);
+   }
+   run ("script_big_file", big.size(), no_setup,
+        [&big] (inode_state& state) { run_script (state, big); });
+}
+
+int main (int argc, char** argv) {
+   execname (argv[0]);
+   for (;;) {
+      int option = getopt (argc, argv, "n:");
+      if (option == EOF) break;
+      if (option == 'n') {
+         scale = max (1, atoi (optarg));
+      } else {
+         complain() << "usage: " << execname() << " [-n scale] [name...]"
+                    << endl;
+         return exit_status::get();
+      }
+   }
+   for (int arg = optind; arg < argc; ++arg) selected.push_back (argv[arg]);
+   micro_benchmarks();
+   macro_benchmarks();
+   return exit_status::get();
+}
+
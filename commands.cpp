@@ -2,32 +2,241 @@
 
 #include "commands.h"
 #include "debug.h"
+#include "hostfs.h"
+#include "journal.h"
+#include "output.h"
+#include "stats.h"
+#include "traverse.h"
+#include <array>
+#include <map>
 #include <regex>
+#include <sys/stat.h>
+
+// The built-in commands.  A perfect hash over their names is found at
+// compile time, so dispatch costs a multiply, a table load and one
+// comparison, and never copies the name.  Commands added at run time
+// go in registered_commands, which is searched only on a miss.  Each
+// command's metrics sit beside it, in builtin_metrics for the
+// built-in ones.  A command that changes the filesystem is marked as
+// a writer, and so is save, which writes through a fixed temporary
+// name; commands added at run time are all taken to be writers.  A
+// command the journal must replay is marked as journaled, which is
+// every writer but save, and cd and prompt, which change only the
+// session they run in.
+
+struct command_entry {
+   string_view name;
+   command_fn fn;
+   bool writer;
+   bool journaled;
+};
+
+static constexpr command_entry builtin_commands[] {
+   {"cat"       , fn_cat       , false, false},
+   {"cd"        , fn_cd        , false, true },
+   {"checkpoint", fn_checkpoint, true , true },
+   {"cp"        , fn_cp        , true , true },
+   {"du"        , fn_du        , false, false},
+   {"echo"      , fn_echo      , false, false},
+   {"exit"      , fn_exit      , false, false},
+   {"export"    , fn_export    , false, false},
+   {"import"    , fn_import    , true , true },
+   {"load"      , fn_load      , true , true },
+   {"ls"        , fn_ls        , false, false},
+   {"lsr"       , fn_lsr       , false, false},
+   {"make"      , fn_make      , true , true },
+   {"mkdir"     , fn_mkdir     , true , true },
+   {"prompt"    , fn_prompt    , false, true },
+   {"pwd"       , fn_pwd       , false, false},
+   {"rm"        , fn_rm        , true , true },
+   {"rmr"       , fn_rmr       , true , true },
+   {"rollback"  , fn_rollback  , true , true },
+   {"save"      , fn_save      , true , false},
+   {"stats"     , fn_stats     , false, false},
+};
 
-command_hash cmd_hash {
-   {"cat"   , fn_cat   },
-   {"cd"    , fn_cd    },
-   {"echo"  , fn_echo  },
-   {"exit"  , fn_exit  },
-   {"ls"    , fn_ls    },
-   {"lsr"   , fn_lsr   },
-   {"make"  , fn_make  },
-   {"mkdir" , fn_mkdir },
-   {"prompt", fn_prompt},
-   {"pwd"   , fn_pwd   },
-   {"rm"    , fn_rm    },
-   {"rmr"   , fn_rmr   },
+static command_metrics builtin_metrics[size (builtin_commands)];
+
+struct registered_command {
+   command_fn fn;
+   command_metrics metrics;
 };
 
-command_fn find_command_fn (const string& cmd) {
-   // Note: value_type is pair<const key_type, mapped_type>
-   // So: iterator->first is key_type (string)
-   // So: iterator->second is mapped_type (command_fn)
-   const auto result = cmd_hash.find (cmd);
-   if (result == cmd_hash.end()) {
-      throw command_error (cmd + ": no such function");
+using command_map = map<string,registered_command,less<>>;
+
+static constexpr size_t COMMAND_BITS = 6;
+static constexpr size_t COMMAND_SLOTS = size_t (1) << COMMAND_BITS;
+static_assert (size (builtin_commands) < COMMAND_SLOTS / 2,
+               "too many built-in commands for the dispatch table");
+
+// The length and the first two and last characters are enough to
+// tell the command names apart without looking at the rest.
+static constexpr uint32_t command_key (string_view name) {
+   uint32_t first = static_cast<unsigned char> (name[0]);
+   uint32_t second = name.size() > 1
+                   ? static_cast<unsigned char> (name[1]) : 0;
+   uint32_t last = static_cast<unsigned char> (name[name.size() - 1]);
+   return first | second << 8 | last << 16
+        | static_cast<uint32_t> (name.size()) << 24;
+}
+
+static constexpr size_t command_slot (string_view name,
+                                      uint32_t multiplier) {
+   return (command_key (name) * multiplier) >> (32 - COMMAND_BITS);
+}
+
+static constexpr bool is_perfect (uint32_t multiplier) {
+   bool used[COMMAND_SLOTS] {};
+   for (const command_entry& entry: builtin_commands) {
+      size_t slot = command_slot (entry.name, multiplier);
+      if (used[slot]) return false;
+      used[slot] = true;
+   }
+   return true;
+}
+
+static constexpr uint32_t find_multiplier() {
+   for (uint32_t tries = 0; tries < 65536; ++tries) {
+      uint32_t multiplier = 0x9E3779B1u + 2 * tries;
+      if (is_perfect (multiplier)) return multiplier;
+   }
+   return 0;
+}
+
+static constexpr uint32_t COMMAND_MULTIPLIER = find_multiplier();
+static_assert (COMMAND_MULTIPLIER != 0,
+               "no perfect hash for the built-in command names");
+
+static constexpr array<int8_t,COMMAND_SLOTS> make_command_slots() {
+   array<int8_t,COMMAND_SLOTS> slots {};
+   for (size_t slot = 0; slot < COMMAND_SLOTS; ++slot) slots[slot] = -1;
+   for (size_t index = 0; index < size (builtin_commands); ++index) {
+      slots[command_slot (builtin_commands[index].name,
+                          COMMAND_MULTIPLIER)] = index;
+   }
+   return slots;
+}
+
+static constexpr array<int8_t,COMMAND_SLOTS> command_slots
+                 = make_command_slots();
+
+static command_map& registered_commands() {
+   static command_map commands;
+   return commands;
+}
+
+static int find_builtin (string_view cmd) {
+   if (cmd.empty()) return -1;
+   int index = command_slots[command_slot (cmd, COMMAND_MULTIPLIER)];
+   if (index < 0 or builtin_commands[index].name != cmd) return -1;
+   return index;
+}
+
+// Finds a command along with the place its metrics are kept,
+// whether it changes the filesystem and whether it is journaled.
+static command_fn find_command (string_view cmd,
+                                command_metrics*& metrics,
+                                bool& writer, bool& journaled) {
+   int index = find_builtin (cmd);
+   if (index >= 0) {
+      metrics = &builtin_metrics[index];
+      writer = builtin_commands[index].writer;
+      journaled = builtin_commands[index].journaled;
+      return builtin_commands[index].fn;
    }
-   return result->second;
+   command_map& registered = registered_commands();
+   const auto result = registered.find (cmd);
+   if (result == registered.end()) {
+      throw command_error (string (cmd) + ": no such function");
+   }
+   metrics = &result->second.metrics;
+   writer = true;
+   journaled = true;
+   return result->second.fn;
+}
+
+command_fn find_command_fn (string_view cmd) {
+   command_metrics* metrics;
+   bool writer;
+   bool journaled;
+   return find_command (cmd, metrics, writer, journaled);
+}
+
+bool register_command (string_view cmd, command_fn fn) {
+   if (cmd.empty() or find_builtin (cmd) >= 0) return false;
+   auto added = registered_commands().try_emplace (string (cmd));
+   if (not added.second) return false;
+   added.first->second.fn = fn;
+   return true;
+}
+
+shared_mutex& filesystem_lock() {
+   static shared_mutex lock;
+   return lock;
+}
+
+void run_command (inode_state& state, const wordspan& words) {
+   command_metrics* metrics;
+   bool writer;
+   bool journaled;
+   command_fn fn = find_command (words.at(0), metrics, writer,
+                                 journaled);
+   uint64_t allocations = stats::allocations();
+   uint64_t start = stats::cycles();
+   auto record = [&] (bool failed) {
+      metrics->cycles.record (stats::cycles() - start);
+      metrics->allocations.fetch_add (stats::allocations() - allocations,
+                                      memory_order_relaxed);
+      metrics->calls.fetch_add (1, memory_order_relaxed);
+      if (failed) metrics->failures.fetch_add (1, memory_order_relaxed);
+   };
+   try {
+      if (writer) {
+         lock_guard<shared_mutex> writing (filesystem_lock());
+         string cwd;
+         journaled = journaled and journal::enabled();
+         if (journaled) cwd = state.current_path();
+         try {
+            fn (state, words);
+         }catch (...) {
+            if (journaled) {
+               journal::append (state, cwd, words, false, true);
+            }
+            throw;
+         }
+         if (journaled) {
+            journal::append (state, cwd, words, false, false);
+            journal::compact_if_due();
+         }
+      }else {
+         shared_lock<shared_mutex> reading (filesystem_lock());
+         string cwd;
+         journaled = journaled and journal::enabled();
+         if (journaled) cwd = state.current_path();
+         fn (state, words);
+         if (journaled) journal::append (state, cwd, words, true, false);
+      }
+   }catch (ysh_exit&) {
+      record (false);
+      throw;
+   }catch (...) {
+      record (true);
+      throw;
+   }
+   record (false);
+}
+
+// Every command with its metrics, built-in ones first.
+static vector<named_metrics> all_metrics() {
+   vector<named_metrics> commands;
+   for (size_t index = 0; index < size (builtin_commands); ++index) {
+      commands.push_back ({builtin_commands[index].name,
+                           &builtin_metrics[index]});
+   }
+   for (const auto& command: registered_commands()) {
+      commands.push_back ({command.first, &command.second.metrics});
+   }
+   return commands;
 }
 
 command_error::command_error (const string& what):
@@ -35,77 +244,101 @@ command_error::command_error (const string& what):
 }
 
 int exit_status_message() {
+   stats::dump_json_file (all_metrics());
    int exit_status = exit_status::get();
    cout << execname() << ": exit(" << exit_status << ")" << endl;
    return exit_status;
 }
 
 /* check_validity -
-      Checks if a given wordvec represents a valid path either from
-      root or from the current directory as specified by the third
-      parameter. Doesn't live in util.cpp because it needs to know what
-      states are.
+      Resolves a pathname either from root or from the current
+      directory, depending on whether it starts with a slash.  The
+      resolver reports misses by status; here they become a
+      command_error for the command loop to print.
+   check_parent_validity -
+      Same, but resolves only the directory that would contain the
+      last component, which is returned in leaf.
 */
-inode_ptr check_validity(inode_state& state,
-                         wordvec path_to_check,
-                         bool check_from_root) {
-   inode_ptr pos;
-   if (check_from_root) {
-      pos = state.get_root();
-   } else pos = state.current_dir();
-
-   uint depth = 0;
-
-   while (depth < path_to_check.size()) {
-      try {
-         pos = pos->get_child_directory(path_to_check.at(depth));
-         depth++;
-      } catch (...) {
-         throw command_error ("file system: path does not exist");
-      }
+static void path_error (path_status status) {
+   switch (status) {
+      case path_status::NOT_FOUND:
+           throw command_error ("file system: path does not exist");
+      case path_status::NOT_A_DIRECTORY:
+           throw command_error ("file system: not a directory");
+      case path_status::NO_NAME:
+           throw command_error ("file system: missing file name");
+      case path_status::OK:
+           break;
    }
+}
+
+inode_ptr check_validity(inode_state& state, string_view path) {
+   inode_ptr node;
+   path_error (state.resolve (path, node));
+   return node;
+}
 
-   return pos;
+inode_ptr check_parent_validity(inode_state& state, string_view path,
+                                string_view& leaf) {
+   inode_ptr dir;
+   path_error (state.resolve_parent (path, dir, leaf));
+   return dir;
 }
 
+/* recursive_remove -
+      Releases a node and everything below it back to the inode
+      table.  Leaves the dirent naming the node, if any, for the
+      caller to dispose of.
+*/
 void recursive_remove(inode_ptr node) {
    if (node -> get_file_type() == file_type::DIRECTORY_TYPE) {
-      wordvec child_names = node -> get_child_names();
-
-      // start at 2 so we skip over . and ..
-      for (uint i = 2; i < child_names.size(); i++) {
-         inode_ptr kid = node->get_child_directory(child_names.at(i));
-         recursive_remove(kid);
+      for (dirent_view child: node -> children()) {
+         if (child.name == "." or child.name == "..") continue;
+         recursive_remove(child.node);
       }
    }
+   inode_table::release(node);
+}
 
-   node->get_parent()->remove(node->get_name());
+/* verified_teardown -
+      Releases every inode one at a time, then checks that nothing is
+      left in the inode_table or the dentry_cache.  Leftovers are
+      reported and make the exit status nonzero.  Checkpoints are
+      released first, since they are not under the root.
+*/
+void verified_teardown(inode_state& state) {
+   checkpoints::release_all();
+   recursive_remove(state.get_root());
+   size_t leaked_inodes = inode_table::size();
+   size_t leaked_dentries = dentry_cache::size();
+   if (leaked_inodes > 0 or leaked_dentries > 0) {
+      complain() << "teardown: " << leaked_inodes << " inodes and "
+                 << leaked_dentries << " cached paths left over"
+                 << endl;
+   }
+   inode_table::clear();
 }
 
-void fn_cat (inode_state& state, const wordvec& words){
+void fn_cat (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
    // First, let's check our arguments - we should have one or more
    if (words.size() < 2) throw command_error ("cat: too few operands");
 
-   // Print the contents of each file to cout
+   // Print the contents of each file to the output
    for (uint i = 1; i < words.size(); i++) {
-      // First, let's try and parse the file path string into a wordvec
-      wordvec file_path = split(words.at(i), "/");
-      inode destination = *check_validity(state,
-                                          file_path,
-                                          (words.at(1).at(0) == '/'));
+      inode& destination = *check_validity(state, words.at(i));
 
       // Check if the file is a file, and then print it oot.
       if (destination.get_file_type() == file_type::PLAIN_TYPE) {
-         cout << destination << endl;
+         state.output() << destination << '\n';
          //cout << "TEST!" << endl;
       } else throw command_error ("cat: can't cat a directory!");
    }
 }
 
-void fn_cd (inode_state& state, const wordvec& words){
+void fn_cd (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
@@ -115,11 +348,11 @@ void fn_cd (inode_state& state, const wordvec& words){
    // If we're given an argument, see if it's a valid path and change to
    // that directory
    if (words.size() == 2) {
-      // First, let's try and parse the file path string into a wordvec
-      wordvec file_path = split(words.at(1), "/");
-      inode_ptr destination_dir = check_validity(state,
-                                           file_path,
-                                           (words.at(1).at(0) == '/'));
+      inode_ptr destination_dir = check_validity(state, words.at(1));
+      if (destination_dir -> get_file_type() !=
+          file_type::DIRECTORY_TYPE) {
+         throw command_error ("cd: not a directory");
+      }
 
       // Change current dir
       state.set_directory(destination_dir);
@@ -131,13 +364,156 @@ void fn_cd (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_echo (inode_state& state, const wordvec& words){
+/* fn_cp -
+      Copies a plain file, or with -r a directory and everything in
+      it.  If the destination is a directory, the copy goes in it
+      under the source's own name; otherwise it is made under the
+      destination's last component.  A plain file already there is
+      replaced, but not a directory.  The copy comes from clone_tree,
+      so it costs an inode per node and the text of every file is
+      shared until one side writes it.
+*/
+// Works out where a copy goes:  into the destination under the
+// name it already has, if the destination is a directory, or else
+// in the destination's parent under its last component, which then
+// replaces name.
+static inode_ptr copy_target (inode_state& state, string_view destination,
+                              string& name) {
+   inode_ptr target_dir;
+   if (state.resolve(destination, target_dir) == path_status::OK
+       and target_dir -> get_file_type() == file_type::DIRECTORY_TYPE) {
+      return target_dir;
+   }
+   string_view leaf;
+   target_dir = check_parent_validity(state, destination, leaf);
+   name = leaf;
+   return target_dir;
+}
+
+void fn_cp (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   bool recursive = words.size() >= 2 and words.at(1) == "-r";
+   size_t first_operand = recursive ? 2 : 1;
+   if (words.size() != first_operand + 2) {
+      throw command_error ("cp: usage: cp [-r] source destination");
+   }
+   inode_ptr source = check_validity(state, words.at(first_operand));
+   bool is_directory = source -> get_file_type() ==
+                       file_type::DIRECTORY_TYPE;
+   if (is_directory and not recursive) {
+      throw command_error ("cp: source is a directory (use -r)");
+   }
+
+   // Work out the directory the copy goes in and its name there
+   string name = source -> get_name();
+   inode_ptr target_dir = copy_target(state, words.at(first_operand + 1),
+                                      name);
+   if (name.empty() or name == "." or name == "..") {
+      throw command_error ("cp: cannot copy to . or ..");
+   }
+   if (is_directory) {
+      for (inode_ptr dir = target_dir; dir; dir = dir -> get_parent()) {
+         if (dir == source) {
+            throw command_error ("cp: cannot copy a directory into "
+                                 "itself");
+         }
+         if (dir == state.get_root()) break;
+      }
+   }
+   inode_ptr existing = target_dir -> lookup(name);
+   if (existing and (is_directory or existing -> get_file_type() ==
+                                     file_type::DIRECTORY_TYPE)) {
+      throw command_error ("cp: " + name + " already exists");
+   }
+
+   // Copy before replacing, in case the file is copied onto itself
+   inode_ptr copy = inode_table::clone_tree(source);
+   if (existing) target_dir -> remove(name);
+   target_dir -> attach(name, copy);
+}
+
+/* fn_checkpoint -
+      Saves a version of the whole filesystem and prints its number,
+      for rollback.  With -l, lists the versions with what is in
+      them, and with -d, releases one.
+*/
+static int checkpoint_id (string_view word) {
+   if (word.empty() or word.size() > 9
+       or word.find_first_not_of ("0123456789") != string_view::npos) {
+      throw command_error (string (word) + ": not a checkpoint number");
+   }
+   return stoi (string (word));
+}
+
+void fn_checkpoint (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
-   cout << word_range (words.cbegin() + 1, words.cend()) << endl;
+
+   ostream& out = state.output();
+   if (words.size() == 1) {
+      out << "checkpoint " << checkpoints::take(state.get_root())
+          << '\n';
+   } else if (words.size() == 2 and words.at(1) == "-l") {
+      for (const auto& version: checkpoints::versions()) {
+         subtree_totals totals = version.second -> totals();
+         out << version.first << ": " << totals.files << " files, "
+             << totals.dirs << " directories, " << totals.bytes
+             << " bytes" << '\n';
+      }
+   } else if (words.size() == 3 and words.at(1) == "-d") {
+      if (not checkpoints::release(checkpoint_id(words.at(2)))) {
+         throw command_error ("checkpoint: no checkpoint "
+                              + string (words.at(2)));
+      }
+   } else {
+      throw command_error ("checkpoint: usage: checkpoint [-l | -d id]");
+   }
 }
 
-void fn_exit (inode_state& state, const wordvec& words){
+/* fn_du -
+      Prints the bytes in plain files, the number of plain files and
+      the number of directories at or below each operand, or the
+      current directory if there are none, followed by the operand.
+      These come from the totals kept in every directory, so the
+      subtree is never walked.
+*/
+void fn_du (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   constexpr size_t COLUMN_WIDTH {5};
+   char columns[96];
+   char* end = columns + sizeof columns;
+   size_t operands = max<size_t> (words.size(), 2);
+   for (size_t i = 1; i < operands; i++) {
+      string_view path = i < words.size() ? words.at(i) : ".";
+      subtree_totals totals = check_validity(state, path) -> totals();
+
+      // Fill in the columns from the right, then add the name.
+      char* first = end;
+      *--first = ' ';
+      *--first = ' ';
+      first = format_padded(first, totals.dirs, COLUMN_WIDTH);
+      *--first = ' ';
+      *--first = ' ';
+      first = format_padded(first, totals.files, COLUMN_WIDTH);
+      *--first = ' ';
+      *--first = ' ';
+      first = format_padded(first, totals.bytes, COLUMN_WIDTH);
+      state.output().write(first, end - first);
+      state.output() << path << '\n';
+   }
+}
+
+void fn_echo (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   state.output() << word_range (words.cbegin() + 1, words.cend()) << '\n';
+}
+
+void fn_exit (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
@@ -146,7 +522,7 @@ void fn_exit (inode_state& state, const wordvec& words){
    if (words.size() > 1) {
       // We only care about the value of the first token after the
       // command itself
-      string exitArg = words.at(1);
+      string exitArg (words.at(1));
       for (uint i = 0; i < exitArg.size(); i++) {
          // if (exitArt is non-numeric) {
          if (exitArg.at(i) < '0' or exitArg.at(i) > '9') {
@@ -158,212 +534,505 @@ void fn_exit (inode_state& state, const wordvec& words){
    }
    exit_status::set(status);
 
-   // Cleans out the entire filesystem
-   recursive_remove(state.get_root());
-
+   // The filesystem is disposed of by main on the way out
    throw ysh_exit();
 }
 
-void fn_ls (inode_state& state, const wordvec& words){
+/* fn_export -
+      Writes a file or directory tree out to the host, into the host
+      path under its own name if that is a directory, or else as the
+      host path.  The root has no name, so it is written into the
+      host directory itself.
+*/
+void fn_export (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   // If we're given an argument, see if it's a valid path
-   if (words.size() >= 2) {
-      for (uint i = 1; i < words.size(); i++) {
-         // First, let's try and parse the file path string
-         // into a wordvec
-         wordvec file_path = split(words.at(i), "/");
-         inode destination_dir = *check_validity(state,
-                                           file_path,
-                                           (words.at(i).at(0) == '/'));
+   if (words.size() != 3) {
+      throw command_error ("export: usage: export path host-path");
+   }
+   inode_ptr source = check_validity(state, words.at(1));
+   string host_path (words.at(2));
+   struct stat info;
+   if (source != state.get_root()
+       and stat(host_path.c_str(), &info) == 0 and S_ISDIR(info.st_mode)) {
+      host_path += "/" + source -> get_name();
+   }
+   export_tree(source, host_path);
+}
 
-         // Show the file
-         cout << destination_dir << endl;
-      }
+/* fn_import -
+      Reads a host file or directory tree in, the way cp -r copies
+      one:  into the destination under the host name if that is a
+      directory, or else as the destination.  A plain file already
+      there is replaced, but not a directory, and nothing changes
+      unless the whole host tree could be read.
+*/
+void fn_import (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   if (words.size() != 3) {
+      throw command_error ("import: usage: import host-path path");
    }
-   // Otherwise, show the contents of the current location
-   else {
-      inode currentDir = *state.current_dir();
-      cout << currentDir << endl;
+   string host_path (words.at(1));
+   string name (host_path);
+   while (name.size() > 1 and name.back() == '/') name.pop_back();
+   name.erase(0, name.find_last_of('/') + 1);
+   inode_ptr target_dir = copy_target(state, words.at(2), name);
+   if (name.empty() or name == "." or name == "..") {
+      throw command_error ("import: name the destination");
    }
+   inode_ptr existing = target_dir -> lookup(name);
+   if (existing and existing -> get_file_type() ==
+                    file_type::DIRECTORY_TYPE) {
+      throw command_error ("import: " + name + " already exists");
+   }
+   inode_ptr tree = import_tree(host_path, name);
+   if (existing and tree -> get_file_type() ==
+                    file_type::DIRECTORY_TYPE) {
+      inode_table::release_tree(tree);
+      throw command_error ("import: " + name + " already exists");
+   }
+   if (existing) target_dir -> remove(name);
+   target_dir -> attach(name, tree);
 }
 
-void recursive_print(inode_ptr inode) {
-   cout << *inode << endl;
-   wordvec child_names = inode -> get_child_names();
+void fn_ls (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   // With -s, the size column shows the bytes in each subtree
+   bool subtree_sizes = words.size() >= 2 and words.at(1) == "-s";
+   size_t first_operand = subtree_sizes ? 2 : 1;
 
-   // Start at two so we skip . and ..
-   for (uint i = 2; i < child_names.size(); i++) {
-      inode_ptr child = inode -> get_child_directory(child_names.at(i));
+   // If we're given an argument, see if it's a valid path
+   if (words.size() > first_operand) {
+      for (size_t i = first_operand; i < words.size(); i++) {
+         inode& destination_dir = *check_validity(state, words.at(i));
 
-      if (child -> get_file_type() == file_type::DIRECTORY_TYPE) {
-         recursive_print(child);
+         // Show the file
+         destination_dir.print(state.output(), subtree_sizes);
+         state.output() << '\n';
       }
    }
+   // Otherwise, show the contents of the current location
+   else {
+      inode& currentDir = *state.current_dir();
+      currentDir.print(state.output(), subtree_sizes);
+      state.output() << '\n';
+   }
 }
 
-void fn_lsr (inode_state& state, const wordvec& words){
+void fn_lsr (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
    // If we're given an argument, see if it's a valid path and show that
    if (words.size() >= 2) {
       for (uint i = 1; i < words.size(); i++) {
-         // First, let's try and parse the file path string into a
-         // wordvec
-         wordvec file_path = split(words.at(i), "/");
-         inode_ptr destination_dir = check_validity(state,
-                                           file_path,
-                                           (words.at(i).at(0) == '/'));
+         inode_ptr destination_dir = check_validity(state, words.at(i));
+         if (destination_dir -> get_file_type() !=
+             file_type::DIRECTORY_TYPE) {
+            throw command_error ("lsr: not a directory");
+         }
 
          // Show the file
-         recursive_print(destination_dir);
+         print_tree(state.output(), destination_dir);
       }
    }
    // Otherwise, show the contents of the current location
    else {
       inode_ptr currentDir = state.current_dir();
-      recursive_print(currentDir);
+      print_tree(state.output(), currentDir);
    }
 }
 
-/* make_helper
-      fn_make and fn_mkdir have a lot of shared logic, but are still
-      called as separate functions. make_helper handles logic that is
-      common to both functions.
+/* operand_walk -
+      Resolves the directories that hold a run of operands, sorted by
+      sorted_operands so that those under the same directories are
+      next to each other.  The directories walked for one operand are
+      kept, with how many components led to each, and the next starts
+      from the deepest one its own path shares, so a batch of paths
+      in one place pays for that place once.  A walk that shares
+      nothing goes through resolve_parent and so the dentry_cache.
+      With create, directories missing along the way are made, as
+      mkdir -p makes them.  A path through ".." is walked on its own,
+      since what it shares by name may not be the same directories.
+   parent -
+      Returns the directory that would hold the last component of
+      the path, which is left in leaf.
+   entered -
+      Records the leaf of the last path as a directory, for paths
+      below it to start from.
 */
-inode_ptr make_helper(inode_state& state,
-                      const wordvec& words,
-                      bool is_directory) {
-   // First, let's try and parse the file path string into a wordvec
-   wordvec file_path = split(words.at(1), "/");
+class operand_walk {
+   private:
+      struct walked {
+         size_t depth;
+         inode_ptr dir;
+      };
+      inode_state& state;
+      bool create;
+      inode_ptr base;
+      vector<string_view> names;
+      vector<walked> dirs;
+      string_view last_leaf;
+   public:
+      operand_walk (inode_state& state_, bool create_):
+                    state (state_), create (create_) {}
+      inode_ptr parent (string_view path, string_view& leaf);
+      void entered (inode_ptr dir);
+};
 
-   // Then, we'll check to see if the path is valid
-   wordvec path_to_check = file_path;
+// The components of a path, without empty ones or ".", and with the
+// last one left out and put in leaf.
+static vector<string_view> path_names (string_view path,
+                                       string_view& leaf) {
+   vector<string_view> names;
+   leaf = string_view();
+   for (size_t end = 0;;) {
+      size_t start = skip_delimiters (path, end, SLASH);
+      if (start == string_view::npos) break;
+      end = find_delimiter (path, start, SLASH);
+      if (end == string_view::npos) end = path.size();
+      if (not leaf.empty() and leaf != ".") names.push_back (leaf);
+      leaf = path.substr (start, end - start);
+   }
+   return names;
+}
 
-   // We don't bother to check the last element, because that will be
-   // the new element
-   bool make_from_root = (words.at(1).at(0) == '/');
-   path_to_check.erase(path_to_check.end());
+inode_ptr operand_walk::parent (string_view path, string_view& leaf) {
+   inode_ptr start = (not path.empty() and path.front() == '/')
+                   ? state.get_root() : state.current_dir();
+   vector<string_view> path_dirs = path_names (path, leaf);
+   if (leaf.empty()) path_error (path_status::NO_NAME);
+   bool climbs = find (path_dirs.begin(), path_dirs.end(), "..")
+              != path_dirs.end();
+   if (start != base or climbs) {
+      names.clear();
+      dirs.clear();
+      base = start;
+   }
+   size_t shared = mismatch (names.begin(), names.end(),
+                             path_dirs.begin(), path_dirs.end()).first
+                 - names.begin();
+   while (not dirs.empty() and dirs.back().depth > shared) {
+      dirs.pop_back();
+   }
+   names = move (path_dirs);
+   last_leaf = string_view();
+
+   size_t depth = dirs.empty() ? 0 : dirs.back().depth;
+   inode_ptr dir = dirs.empty() ? base : dirs.back().dir;
+   if (depth == 0 and not names.empty()) {
+      string_view ignored;
+      path_status status = state.resolve_parent (path, dir, ignored);
+      if (status == path_status::OK) {
+         depth = names.size();
+         dirs.push_back ({depth, dir});
+      }else if (create and status == path_status::NOT_FOUND) {
+         dir = base;
+      }else path_error (status);
+   }
+   for (; depth < names.size(); ++depth) {
+      inode_ptr next = dir -> lookup (names[depth]);
+      if (not next and create) {
+         next = dir -> make_dir (string (names[depth]));
+      }
+      if (not next) path_error (path_status::NOT_FOUND);
+      if (next -> get_file_type() != file_type::DIRECTORY_TYPE) {
+         path_error (path_status::NOT_A_DIRECTORY);
+      }
+      dir = next;
+      dirs.push_back ({depth + 1, dir});
+   }
+   if (climbs) {
+      names.clear();
+      dirs.clear();
+   }else last_leaf = leaf;
+   return dir;
+}
 
-   inode_ptr destination_dir = check_validity(state,
-                                              path_to_check,
-                                              make_from_root);
+void operand_walk::entered (inode_ptr dir) {
+   if (last_leaf.empty() or last_leaf == "." or last_leaf == "..") {
+      return;
+   }
+   names.push_back (last_leaf);
+   dirs.push_back ({names.size(), dir});
+}
 
-   // Create the new file
-   if (is_directory) {
-      return destination_dir->make_dir(file_path.back());
-   } else return destination_dir->make_file(file_path.back());
+// Sorts operands by their components, so that paths under the same
+// directories are next to each other and each comes before those
+// below it, or after them when reversed.  Absolute and relative
+// paths are kept apart.
+static vector<string_view> sorted_operands (const wordspan& words,
+                                            size_t first, bool reversed) {
+   struct operand {
+      bool relative;
+      vector<string_view> names;
+      string_view path;
+   };
+   vector<operand> operands;
+   for (size_t index = first; index < words.size(); ++index) {
+      string_view path = words.at(index);
+      string_view leaf;
+      operand item {path.empty() or path.front() != '/',
+                    path_names (path, leaf), path};
+      item.names.push_back (leaf);
+      operands.push_back (move (item));
+   }
+   stable_sort (operands.begin(), operands.end(),
+                [reversed] (const operand& one, const operand& two) {
+      const operand& left = reversed ? two : one;
+      const operand& right = reversed ? one : two;
+      if (left.relative != right.relative) return right.relative;
+      return lexicographical_compare (left.names.begin(),
+                                      left.names.end(),
+                                      right.names.begin(),
+                                      right.names.end());
+   });
+   vector<string_view> paths;
+   for (const operand& item: operands) paths.push_back (item.path);
+   return paths;
 }
 
-void fn_make (inode_state& state, const wordvec& words){
+// Keeps the first failure of a command that goes on with its other
+// operands, to be rethrown once they are done.
+static void note_failure (exception_ptr& failure) {
+   if (not failure) failure = current_exception();
+}
+
+/* fn_make -
+      Makes a file and writes the rest of the words into it.  With
+      -p, directories missing along the way are made too.  The words
+      after the path are the file's text, so make takes just one.
+*/
+void fn_make (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   // First, let's check our arguments. We should have at least one.
-   if (words.size() == 1) {
+   bool parents = words.size() >= 2 and words.at(1) == "-p";
+   size_t first = parents ? 2 : 1;
+   if (words.size() <= first) {
       throw command_error ("make: missing operands");
    }
 
-   inode_ptr new_file = make_helper(state, words, false);
-
-   // Trim out of the first two elements of words (the function name and
-   // location) and write the remainder to the new file.
-   wordvec file_contents = words;
-   file_contents.erase(file_contents.begin());
-   file_contents.erase(file_contents.begin());
-   new_file -> writefile(file_contents);
+   string_view leaf;
+   inode_ptr destination_dir = operand_walk(state, parents)
+                               .parent(words.at(first), leaf);
+   inode_ptr new_file = destination_dir->make_file(string(leaf));
+
+   // Join the words after the path into the file's text.  The buffer
+   // is sized up front and then moved into the file.
+   size_t length = 0;
+   for (auto word = words.cbegin() + first + 1; word < words.cend();
+        ++word) {
+      length += word->size() + 1;
+   }
+   string file_contents;
+   file_contents.reserve(length);
+   for (auto word = words.cbegin() + first + 1; word < words.cend();
+        ++word) {
+      if (not file_contents.empty()) file_contents += ' ';
+      file_contents += *word;
+   }
+   new_file -> writefile(move(file_contents));
 }
 
-void fn_mkdir (inode_state& state, const wordvec& words){
+/* fn_mkdir -
+      Makes each operand a directory.  With -p, directories missing
+      along the way are made too, and one that already exists is not
+      an error.  The operands are sorted and resolved together by
+      operand_walk, so each is made before any below it.  A failure
+      does not stop the other operands; the first is reported once
+      they are done.
+*/
+void fn_mkdir (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   // First, let's check our arguments. We should have exactly one.
-   if (words.size() == 1) {
+   bool parents = words.size() >= 2 and words.at(1) == "-p";
+   size_t first = parents ? 2 : 1;
+   if (words.size() <= first) {
       throw command_error ("mkdir: missing operand");
-   } else if (words.size() > 2) {
-      throw command_error ("mkdir: only one operand allowed");
    }
 
-   make_helper(state, words, true);
+   operand_walk walk (state, parents);
+   exception_ptr failure;
+   for (string_view path: sorted_operands(words, first, false)) {
+      try {
+         string_view leaf;
+         inode_ptr destination_dir = walk.parent(path, leaf);
+         inode_ptr existing = destination_dir -> lookup(leaf);
+         if (parents and existing and existing -> get_file_type() ==
+                                      file_type::DIRECTORY_TYPE) {
+            walk.entered(existing);
+            continue;
+         }
+         walk.entered(destination_dir -> make_dir(string(leaf)));
+      }catch (command_error&) {
+         note_failure (failure);
+      }catch (file_error&) {
+         note_failure (failure);
+      }
+   }
+   if (failure) rethrow_exception (failure);
 }
 
-void fn_prompt (inode_state& state, const wordvec& words){
+void fn_prompt (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
    if (words.size() > 1) {
       string new_prompt("");
       for (uint i = 1; i < words.size(); i++) {
-         new_prompt = new_prompt + words.at(i) + " ";
+         new_prompt.append(words.at(i).data(), words.at(i).size());
+         new_prompt += " ";
       }
 
       state.set_prompt(new_prompt);
    }
 }
 
-void fn_pwd (inode_state& state, const wordvec& words){
+void fn_pwd (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   inode_ptr location = state.current_dir();
-   wordvec current_path;
+   // The current directory keeps its own absolute path
+   state.output() << state.current_path() << '\n';
+}
 
-   while (location != state.get_root()) {
-      current_path.insert(current_path.begin(), location -> get_name());
-      location = location -> get_parent();
-   }
+/* fn_rm -
+      Removes each operand, which must be a plain file or an empty
+      directory.  The operands are resolved together as mkdir's are,
+      and likewise a failure does not stop the others.
+*/
+void fn_rm (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
 
-   for (uint i = 1; i < current_path.size(); i++) {
-      cout << "/" << current_path.at(i);
-   }
+   if (words.size() < 2) throw command_error("rm: too few operands");
 
-   if (current_path.size() == 1) cout << "/";
-   cout << endl;
+   // The operands go in reverse order, so everything under a
+   // directory is removed before the directory itself.
+   operand_walk walk (state, false);
+   exception_ptr failure;
+   for (string_view path: sorted_operands(words, 1, true)) {
+      try {
+         string_view leaf;
+         inode_ptr destination_dir = walk.parent(path, leaf);
+         if (leaf == "." or leaf == "..") {
+            throw command_error ("rm: cannot remove . or ..");
+         }
+
+         // Only an empty directory can be removed, so a current
+         // directory, of this session or any other, can only be
+         // affected if it is the one removed.  Sessions are moved out
+         // before it is released, and only if it will be.
+         inode_ptr destination = destination_dir -> lookup(leaf);
+         if (destination and destination -> get_file_type() ==
+                             file_type::DIRECTORY_TYPE
+             and destination -> size() <= 2) {
+            state.leave_subtree(destination, destination_dir);
+         }
+         destination_dir -> remove(string(leaf));
+      }catch (command_error&) {
+         note_failure (failure);
+      }catch (file_error&) {
+         note_failure (failure);
+      }
+   }
+   if (failure) rethrow_exception (failure);
 }
 
-void fn_rm (inode_state& state, const wordvec& words){
+void fn_rmr (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
    if (words.size() < 2) throw command_error("rm: too few operands");
 
-   // First, let's try and parse the file path string into a wordvec
-   wordvec file_path = split(words.at(1), "/");
+   string_view leaf;
+   inode_ptr parent_dir = check_parent_validity(state,
+                                                words.at(1),
+                                                leaf);
+   if (leaf == "." or leaf == "..") {
+      throw command_error ("rmr: cannot remove . or ..");
+   }
+   if (not parent_dir -> lookup(leaf)) {
+      throw command_error ("file system: path does not exist");
+   }
 
-   // Then, we'll check to see if the path is valid
-   wordvec path_to_check = file_path;
-   bool check_from_root = (words.at(1).at(0) == '/');
+   // Unhook the subtree from its parent, then free all of it at once,
+   // moving any session whose current directory is inside out first
+   state.leave_subtree(parent_dir -> lookup(leaf), parent_dir);
+   inode_ptr destination = parent_dir -> detach(string(leaf));
+   inode_table::release_tree(destination);
+}
 
-   // We don't bother to check the last element, because that will be
-   // the element to remove
-   path_to_check.erase(path_to_check.end());
-   inode_ptr destination_dir = check_validity(state,
-                                              path_to_check,
-                                              check_from_root);
+/* fn_rollback -
+      Replaces the whole filesystem with a copy of a checkpoint and
+      releases what was there.  As with load, every session sharing
+      the filesystem starts over at the root.  The root keeps its
+      inode number; everything below it is numbered afresh.
+*/
+void fn_rollback (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
 
-   // Remove the file
-   destination_dir -> remove(file_path.back());
+   if (words.size() != 2) {
+      throw command_error ("rollback: usage: rollback id");
+   }
+   int id = checkpoint_id(words.at(1));
+   if (checkpoints::versions().count(id) == 0) {
+      throw command_error ("rollback: no checkpoint "
+                           + string (words.at(1)));
+   }
+   inode_ptr root = state.get_root();
+   state.reset(root);
+   checkpoints::restore(id, root);
 }
 
-void fn_rmr (inode_state& state, const wordvec& words){
+void fn_stats (inode_state& state, const wordspan& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
 
-   if (words.size() < 2) throw command_error("rm: too few operands");
+   if (words.size() > 2 or (words.size() == 2 and words.at(1) != "-j")) {
+      throw command_error ("stats: usage: stats [-j]");
+   }
+
+   // -j prints the same as the JSON dump at exit
+   if (words.size() == 2) {
+      stats::write_json(state.output(), all_metrics());
+      return;
+   }
+   ostream& out = state.output();
+   stats::print(out, all_metrics());
+   subtree_totals totals = state.get_root() -> totals();
+   out << "inodes in use: " << inode_table::size()
+       << ", under root: " << totals.files << " files, "
+       << totals.dirs << " directories, " << totals.bytes
+       << " bytes" << '\n';
+}
 
-   // First, let's try and parse the file path string into a wordvec
-   wordvec file_path = split(words.at(1), "/");
+void fn_save (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
 
-   // Then, we'll check to see if the path is valid
-   bool check_from_root = (words.at(1).at(0) == '/');
+   if (words.size() != 2) {
+      throw command_error ("save: exactly one image file required");
+   }
+   inode_table::save(string(words.at(1)), state.get_root());
+}
 
-   inode_ptr destination_dir = check_validity(state,
-                                              file_path,
-                                              check_from_root);
+void fn_load (inode_state& state, const wordspan& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   if (words.size() != 2) {
+      throw command_error ("load: exactly one image file required");
+   }
 
-   // Remove the file
-   recursive_remove(destination_dir);
+   // Replaces the whole filesystem and starts over at its root
+   state.reset(inode_table::load(string(words.at(1))));
 }
@@ -3,7 +3,6 @@
 #ifndef __COMMANDS_H__
 #define __COMMANDS_H__
 
-#include <unordered_map>
 using namespace std;
 
 #include "file_sys.h"
@@ -11,8 +10,7 @@ using namespace std;
 
 // A couple of convenient usings to avoid verbosity.
 
-using command_fn = void (*)(inode_state& state, const wordvec& words);
-using command_hash = unordered_map<string,command_fn>;
+using command_fn = void (*)(inode_state& state, const wordspan& words);
 
 // command_error -
 //    Extend runtime_error for throwing exceptions related to this 
@@ -25,20 +23,72 @@ class command_error: public runtime_error {
 
 // execution functions -
 
-void fn_cat    (inode_state& state, const wordvec& words);
-void fn_cd     (inode_state& state, const wordvec& words);
-void fn_echo   (inode_state& state, const wordvec& words);
-void fn_exit   (inode_state& state, const wordvec& words);
-void fn_ls     (inode_state& state, const wordvec& words);
-void fn_lsr    (inode_state& state, const wordvec& words);
-void fn_make   (inode_state& state, const wordvec& words);
-void fn_mkdir  (inode_state& state, const wordvec& words);
-void fn_prompt (inode_state& state, const wordvec& words);
-void fn_pwd    (inode_state& state, const wordvec& words);
-void fn_rm     (inode_state& state, const wordvec& words);
-void fn_rmr    (inode_state& state, const wordvec& words);
-
-command_fn find_command_fn (const string& command);
+void fn_cat        (inode_state& state, const wordspan& words);
+void fn_cd         (inode_state& state, const wordspan& words);
+void fn_checkpoint (inode_state& state, const wordspan& words);
+void fn_cp         (inode_state& state, const wordspan& words);
+void fn_du         (inode_state& state, const wordspan& words);
+void fn_echo       (inode_state& state, const wordspan& words);
+void fn_exit       (inode_state& state, const wordspan& words);
+void fn_export     (inode_state& state, const wordspan& words);
+void fn_import     (inode_state& state, const wordspan& words);
+void fn_load       (inode_state& state, const wordspan& words);
+void fn_ls         (inode_state& state, const wordspan& words);
+void fn_lsr        (inode_state& state, const wordspan& words);
+void fn_make       (inode_state& state, const wordspan& words);
+void fn_mkdir      (inode_state& state, const wordspan& words);
+void fn_prompt     (inode_state& state, const wordspan& words);
+void fn_pwd        (inode_state& state, const wordspan& words);
+void fn_rm         (inode_state& state, const wordspan& words);
+void fn_rmr        (inode_state& state, const wordspan& words);
+void fn_rollback   (inode_state& state, const wordspan& words);
+void fn_save       (inode_state& state, const wordspan& words);
+void fn_stats      (inode_state& state, const wordspan& words);
+
+// find_command_fn -
+//    Looks up a command by name, first among the built-in commands,
+//    then among those added with register_command.  Throws a
+//    command_error if there is no such command.
+// register_command -
+//    Adds a command that is not built in.  Returns false, and changes
+//    nothing, if the name is already taken.
+// filesystem_lock -
+//    The reader-writer lock over the whole filesystem.  Commands that
+//    only read it hold the lock shared, so the sessions of a server
+//    can list and cat in parallel, while those that change it hold
+//    the lock exclusively.
+// run_command -
+//    Finds the command named by the first word and runs it under the
+//    filesystem_lock, timing it and counting its allocations for the
+//    stats command.  A journaled command is appended to the journal
+//    while the lock is still held, so the journal has the writers in
+//    the order they ran.  A writer that fails is appended too, since
+//    one with several operands may have done some of them.
+
+command_fn find_command_fn (string_view command);
+bool register_command (string_view command, command_fn fn);
+shared_mutex& filesystem_lock();
+void run_command (inode_state& state, const wordspan& words);
+
+// check_validity -
+//    Resolves a pathname from the root or the current directory,
+//    throwing a command_error if it does not exist.
+// check_parent_validity -
+//    Resolves the directory that would contain the last component,
+//    leaving a view of that component in leaf.
+
+inode_ptr check_validity (inode_state& state, string_view path);
+inode_ptr check_parent_validity (inode_state& state, string_view path,
+                                 string_view& leaf);
+
+// recursive_remove -
+//    Releases a node and everything below it, one inode at a time.
+// verified_teardown -
+//    Releases the whole filesystem with recursive_remove and checks
+//    that the inode_table is left empty, complaining if it is not.
+
+void recursive_remove (inode_ptr node);
+void verified_teardown (inode_state& state);
 
 // exit_status_message -
 //    Prints an exit message and returns the exit status, as recorded
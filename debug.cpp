@@ -1,12 +1,17 @@
 // $Id: debug.cpp,v 1.9 2016-01-14 16:16:52-08 - - $
 
 #include <climits>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
 
 #include "debug.h"
+#include "stats.h"
 #include "util.h"
 
 debugflags::flagset debugflags::flags {};
@@ -18,17 +23,150 @@ void debugflags::setflags (const string& initflags) {
    }
 }
 
-// getflag -
-//    Check to see if a certain flag is on.
-
-bool debugflags::getflag (char flag) {
-   // WARNING: Don't TRACE this function or the stack will blow up.
-   return flags.test (static_cast<unsigned char> (flag));
-}
-
 void debugflags::where (char flag, const char* file, int line,
                         const char* func) {
    cout << execname() << ": DEBUG(" << flag << ") "
         << file << "[" << line << "] " << func << "()" << endl;
 }
 
+
+/*** TRACE RING ***/
+trace_record trace_ring::records[CAPACITY];
+atomic<uint64_t> trace_ring::next {0};
+string trace_ring::filename;
+
+void trace_ring::record (const trace_site* site, uint64_t first,
+                         uint64_t second) {
+   uint64_t position = next.fetch_add (1, memory_order_relaxed);
+   trace_record& slot = records[position & (CAPACITY - 1)];
+   slot.seq.store (0, memory_order_relaxed);
+   slot.cycles = stats::cycles();
+   slot.site = site;
+   slot.values[0] = first;
+   slot.values[1] = second;
+   slot.seq.store (position + 1, memory_order_release);
+}
+
+static constexpr char TRACE_MAGIC[8] {'Y','S','H','T','R','C','0','1'};
+
+template <typename value>
+static void put (ostream& out, const value& data) {
+   out.write (reinterpret_cast<const char*> (&data), sizeof data);
+}
+
+static void put_string (ostream& out, const char* text) {
+   uint32_t length = strlen (text);
+   put (out, length);
+   out.write (text, length);
+}
+
+template <typename value>
+static bool get (istream& in, value& data) {
+   return bool (in.read (reinterpret_cast<char*> (&data), sizeof data));
+}
+
+static bool get_string (istream& in, string& text) {
+   uint32_t length;
+   if (not get (in, length) or length > (1 << 20)) return false;
+   text.resize (length);
+   return bool (in.read (&text[0], length));
+}
+
+void trace_ring::save (ostream& out) {
+   uint64_t end = next.load (memory_order_acquire);
+   uint64_t start = end > CAPACITY ? end - CAPACITY : 0;
+   vector<const trace_record*> kept;
+   vector<const trace_site*> sites;
+   unordered_map<const trace_site*,uint32_t> site_index;
+   for (uint64_t position = start; position < end; ++position) {
+      const trace_record& slot = records[position & (CAPACITY - 1)];
+      if (slot.seq.load (memory_order_acquire) != position + 1) continue;
+      kept.push_back (&slot);
+      if (site_index.emplace (slot.site, sites.size()).second) {
+         sites.push_back (slot.site);
+      }
+   }
+
+   out.write (TRACE_MAGIC, sizeof TRACE_MAGIC);
+   put (out, static_cast<uint32_t> (sites.size()));
+   put (out, static_cast<uint32_t> (kept.size()));
+   put (out, stats::nanoseconds_per_cycle());
+   for (const trace_site* site: sites) {
+      put (out, site->flag);
+      put (out, static_cast<uint32_t> (site->arity));
+      put (out, static_cast<uint32_t> (site->line));
+      put_string (out, site->file);
+      put_string (out, site->func);
+      put_string (out, site->message);
+   }
+   for (const trace_record* slot: kept) {
+      put (out, slot->cycles);
+      put (out, site_index[slot->site]);
+      put (out, slot->values[0]);
+      put (out, slot->values[1]);
+   }
+}
+
+bool trace_ring::decode (istream& in, ostream& out) {
+   struct decoded_site {
+      char flag;
+      uint32_t arity;
+      uint32_t line;
+      string file;
+      string func;
+      string message;
+   };
+   char magic[sizeof TRACE_MAGIC];
+   uint32_t site_count;
+   uint32_t record_count;
+   double scale;
+   if (not in.read (magic, sizeof magic)
+       or memcmp (magic, TRACE_MAGIC, sizeof magic) != 0
+       or not get (in, site_count) or not get (in, record_count)
+       or not get (in, scale)) return false;
+   vector<decoded_site> sites (site_count);
+   for (decoded_site& site: sites) {
+      if (not get (in, site.flag) or not get (in, site.arity)
+          or not get (in, site.line) or not get_string (in, site.file)
+          or not get_string (in, site.func)
+          or not get_string (in, site.message)) return false;
+   }
+   uint64_t first_cycles = 0;
+   for (uint32_t count = 0; count < record_count; ++count) {
+      uint64_t cycles;
+      uint32_t index;
+      uint64_t values[2];
+      if (not get (in, cycles) or not get (in, index)
+          or not get (in, values[0]) or not get (in, values[1])
+          or index >= sites.size()) return false;
+      if (count == 0) first_cycles = cycles;
+      const decoded_site& site = sites[index];
+      int64_t elapsed = cycles - first_cycles;
+      out << static_cast<int64_t> (elapsed * scale)
+          << " ns: DEBUG(" << site.flag << ") " << site.file << "["
+          << site.line << "] " << site.func << "(): " << site.message;
+      for (uint32_t value = 0; value < site.arity and value < 2;
+           ++value) {
+         out << " " << values[value];
+      }
+      out << "\n";
+   }
+   return true;
+}
+
+void trace_ring::set_file (const string& trace_file) {
+   filename = trace_file;
+}
+
+void trace_ring::finish() {
+   if (next.load (memory_order_acquire) == 0) return;
+   if (not filename.empty()) {
+      ofstream out (filename, ios::binary | ios::trunc);
+      save (out);
+      if (not out) complain() << filename << ": cannot write trace" << endl;
+      return;
+   }
+   stringstream buffer;
+   save (buffer);
+   decode (buffer, cerr);
+}
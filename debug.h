@@ -3,11 +3,42 @@
 #ifndef __DEBUG_H__
 #define __DEBUG_H__
 
+#include <atomic>
 #include <bitset>
 #include <climits>
+#include <cstdint>
+#include <iostream>
 #include <string>
 using namespace std;
 
+// DEBUG_CATEGORIES -
+//    The flags whose trace code is compiled in at all, as a string,
+//    with '@' meaning every flag.  Set it from the Makefile, as in
+//    make DEBUGCATS=cy, to leave every other category out of the
+//    object code entirely.  NDEBUG leaves them all out.
+// debug_compiled -
+//    Whether a flag's trace code is compiled in.  Evaluated at
+//    compile time by the macros below, which still type-check code
+//    that is left out, so a release build warns about what a debug
+//    build does and no variable is unused only under NDEBUG.
+
+#ifndef DEBUG_CATEGORIES
+#define DEBUG_CATEGORIES "@"
+#endif
+
+constexpr bool debug_compiled (char flag) {
+#ifdef NDEBUG
+   (void) flag;
+   return false;
+#else
+   for (const char* category = DEBUG_CATEGORIES; *category != '\0';
+        ++category) {
+      if (*category == '@' or *category == flag) return true;
+   }
+   return false;
+#endif
+}
+
 // debug -
 //    static class for maintaining global debug flags, each indicated
 //    by a single character.
@@ -16,7 +47,8 @@ using namespace std;
 //    string.  As a special case, '@', sets all flags.
 // getflag -
 //    Used by the DEBUGF macro to check to see if a flag has been set.
-//    Not to be called by user code.
+//    Not to be called by user code.  Inline, so a category that is
+//    compiled in but switched off costs one load and a branch.
 
 class debugflags {
    private:
@@ -24,12 +56,85 @@ class debugflags {
       static flagset flags;
    public:
       static void setflags (const string& optflags);
-      static bool getflag (char flag);
+      static bool getflag (char flag) {
+         // WARNING: Don't TRACE this function or the stack will blow up.
+         return flags[static_cast<unsigned char> (flag)];
+      }
       static void where (char flag, const char* file, int line,
                          const char* func);
 };
 
-
+// trace_site -
+//    Everything about a TRACE call that is fixed at compile time.
+//    Each call site has one, as a static, and records point to it.
+// trace_record -
+//    One binary trace entry:  the cycle counter, the site and up to
+//    two integer values.  seq is the position in the trace plus one,
+//    stored last, so a slot that is still being written is skipped.
+// trace_ring -
+//    A static class holding a fixed ring of records that any thread
+//    can append to without a lock:  a writer claims a slot with one
+//    fetch_add and fills it in.  Once full, the oldest records are
+//    overwritten, so the ring always holds the latest CAPACITY.
+// record -
+//    Appends a record.  Called by the TRACE macro.
+// save -
+//    Writes the records to a stream in the binary format below,
+//    replacing site pointers with indexes into a table of sites.
+// decode -
+//    Reads that format back and prints a line per record, in the
+//    same form as DEBUGF, prefixed by nanoseconds since the first
+//    record.  Returns false if the input is not a trace.
+// finish -
+//    At exit:  saves the ring to the file set by set_file, or if
+//    none was set, decodes it to cerr.  Does nothing if the ring is
+//    empty.
+//
+// The saved format is the magic "YSHTRC01", the number of sites and
+// of records as uint32, then nanoseconds per cycle as a double.  Each
+// site is its flag, then its arity and line as uint32, then the file,
+// function and message as uint32 lengths followed by the characters.
+// Each record is the cycles as uint64, the site index as uint32 and
+// the two values as uint64, all in host byte order.
+
+struct trace_site {
+   char flag;
+   int arity;
+   const char* file;
+   int line;
+   const char* func;
+   const char* message;
+};
+
+// trace_arity -
+//    Never called:  sizeof (trace_arity (args...)) - 1 is the number
+//    of arguments, without evaluating them.
+
+template <typename... values>
+char (&trace_arity (values&&...))[sizeof... (values) + 1];
+
+struct trace_record {
+   atomic<uint64_t> seq;
+   uint64_t cycles;
+   const trace_site* site;
+   uint64_t values[2];
+};
+
+class trace_ring {
+   private:
+      static constexpr size_t CAPACITY {1 << 16};
+      static trace_record records[CAPACITY];
+      static atomic<uint64_t> next;
+      static string filename;
+   public:
+      static void record (const trace_site* site, uint64_t first = 0,
+                          uint64_t second = 0);
+      static void save (ostream& out);
+      static bool decode (istream& in, ostream& out);
+      static void set_file (const string& trace_file);
+      static void finish();
+};
+
 // DEBUGF -
 //    Macro which expands into trace code.  First argument is a
 //    trace flag char, second argument is output code that can
@@ -38,24 +143,39 @@ class debugflags {
 //       DEBUGF ('u', "foo = " << foo);
 //    will print two words and a newline if flag 'u' is  on.
 //    Traces are preceded by filename, line number, and function.
+// TRACE -
+//    The cheap form for hot paths.  Takes a flag, a string literal
+//    and up to two integers, and appends a binary record to the
+//    trace_ring instead of formatting anything.
+//    Example:
+//       TRACE ('i', "size", size);
 
-#ifdef NDEBUG
-#define DEBUGF(FLAG,CODE) ;
-#define DEBUGS(FLAG,STMT) ;
-#else
 #define DEBUGF(FLAG,CODE) { \
-           if (debugflags::getflag (FLAG)) { \
-              debugflags::where (FLAG, __FILE__, __LINE__, __func__); \
-              cerr << CODE << endl; \
+           if constexpr (debug_compiled (FLAG)) { \
+              if (debugflags::getflag (FLAG)) { \
+                 debugflags::where (FLAG, __FILE__, __LINE__, __func__); \
+                 cerr << CODE << endl; \
+              } \
            } \
         }
 #define DEBUGS(FLAG,STMT) { \
-           if (debugflags::getflag (FLAG)) { \
-              debugflags::where (FLAG, __FILE__, __LINE__, __func__); \
-              STMT; \
+           if constexpr (debug_compiled (FLAG)) { \
+              if (debugflags::getflag (FLAG)) { \
+                 debugflags::where (FLAG, __FILE__, __LINE__, __func__); \
+                 STMT; \
+              } \
+           } \
+        }
+#define TRACE(FLAG,MESSAGE,...) { \
+           if constexpr (debug_compiled (FLAG)) { \
+              if (debugflags::getflag (FLAG)) { \
+                 static const trace_site trace_site_ { \
+                    FLAG, sizeof (trace_arity (__VA_ARGS__)) - 1, \
+                    __FILE__, __LINE__, __func__, MESSAGE}; \
+                 trace_ring::record (&trace_site_, ##__VA_ARGS__); \
+              } \
            } \
         }
-#endif
 
 #endif
 
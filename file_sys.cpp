@@ -1,15 +1,32 @@
 // $Id: file_sys.cpp,v 1.5 2016-01-14 16:16:52-08 - - $
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <stdexcept>
 #include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 #include "debug.h"
 #include "file_sys.h"
+#include "output.h"
+#include "stats.h"
 
-int inode::next_inode_nr {1};
+deque<inode> inode_table::inodes;
+deque<plain_file> inode_table::files;
+deque<directory> inode_table::dirs;
+vector<int> inode_table::free_inodes;
+vector<plain_file*> inode_table::free_files;
+vector<directory*> inode_table::free_dirs;
 
 struct file_type_hash {
    size_t operator() (file_type type) const {
@@ -25,23 +42,602 @@ ostream& operator<< (ostream& out, file_type type) {
    return out << hash[type];
 }
 
+ostream& operator<< (ostream& out, inode_ptr ptr) {
+   return out << "inode#" << ptr.get_nr();
+}
+
+/*** INODE TABLE ***/
+inode_ptr inode_table::alloc (file_type type, const string& name) {
+   // Slot 0 is the null handle, so make sure it is never handed out.
+   if (inodes.empty()) inodes.emplace_back (0, type, "", nullptr);
+
+   base_file* contents = nullptr;
+   switch (type) {
+      case file_type::PLAIN_TYPE:
+           if (free_files.empty()) {
+              files.emplace_back();
+              contents = &files.back();
+           } else {
+              contents = free_files.back();
+              free_files.pop_back();
+           }
+           break;
+      case file_type::DIRECTORY_TYPE:
+           if (free_dirs.empty()) {
+              dirs.emplace_back();
+              contents = &dirs.back();
+           } else {
+              contents = free_dirs.back();
+              free_dirs.pop_back();
+           }
+           break;
+   }
+
+   int inode_nr;
+   if (free_inodes.empty()) {
+      inode_nr = inodes.size();
+      inodes.emplace_back (inode_nr, type, name, contents);
+   } else {
+      inode_nr = free_inodes.back();
+      free_inodes.pop_back();
+      inodes[inode_nr] = inode (inode_nr, type, name, contents);
+   }
+   TRACE ('i', "alloc inode, type", inode_nr, int (type));
+   return inode_ptr (inode_nr);
+}
+
+void inode_table::release (inode_ptr ptr) {
+   inode& node = *ptr;
+   TRACE ('i', "release inode", node.inode_nr);
+   dentry_cache::forget (ptr);
+   switch (node.type) {
+      case file_type::PLAIN_TYPE:
+           node.file().clear();
+           free_files.push_back (&node.file());
+           break;
+      case file_type::DIRECTORY_TYPE:
+           node.dir().clear();
+           free_dirs.push_back (&node.dir());
+           break;
+   }
+   node.contents = nullptr;
+   node.name.clear();
+   free_inodes.push_back (node.inode_nr);
+}
+
+void inode_table::release_tree (inode_ptr top) {
+   vector<inode_ptr> nodes {top};
+   for (size_t next = 0; next < nodes.size(); ++next) {
+      inode& node = *nodes[next];
+      if (node.type != file_type::DIRECTORY_TYPE) continue;
+      for (dirent_view child: node.dir().entries()) {
+         if (child.name == "." or child.name == "..") continue;
+         nodes.push_back (child.node);
+      }
+   }
+   TRACE ('i', "release_tree inodes", nodes.size());
+
+   parallel_for (nodes.size(), [&nodes] (size_t index) {
+      inode& node = *nodes[index];
+      if (node.type == file_type::PLAIN_TYPE) node.file().clear();
+                                         else node.dir().clear();
+      node.name.clear();
+   });
+
+   for (inode_ptr ptr: nodes) {
+      inode& node = *ptr;
+      dentry_cache::forget (ptr);
+      if (node.type == file_type::PLAIN_TYPE) {
+         free_files.push_back (&node.file());
+      } else free_dirs.push_back (&node.dir());
+      node.contents = nullptr;
+      free_inodes.push_back (node.inode_nr);
+   }
+}
+
+// Breadth first, so every directory is copied before its children,
+// which are allocated as its copied dirents are visited.
+inode_ptr inode_table::clone_tree (inode_ptr top) {
+   vector<pair<inode_ptr,inode_ptr>> copies;
+   copies.emplace_back (top, alloc (top->type, top->name));
+   for (size_t next = 0; next < copies.size(); ++next) {
+      inode_ptr original = copies[next].first;
+      inode_ptr copy = copies[next].second;
+      if (original->type == file_type::PLAIN_TYPE) {
+         copy->file().share (original->file());
+         continue;
+      }
+      const directory& from = original->dir();
+      directory& to = copy->dir();
+      to.dirents = from.dirents;
+      to.index = from.index;
+      to.below = from.below;
+      if (from.sorted_valid) {
+         to.sorted = from.sorted;
+         to.sorted_valid = true;
+      }
+      for (dirent& entry: to.dirents) {
+         if (entry.name == ".") {
+            entry.node = copy;
+            continue;
+         }
+         if (entry.name == "..") {
+            entry.node = copy->parent ? copy->parent : copy;
+            continue;
+         }
+         inode_ptr child = alloc (entry.type, entry.name);
+         child->parent = copy;
+         copies.emplace_back (entry.node, child);
+         entry.node = child;
+      }
+   }
+   TRACE ('i', "clone_tree inodes", copies.size());
+   return copies.front().second;
+}
+
+size_t inode_table::size() {
+   if (inodes.empty()) return 0;
+   return inodes.size() - 1 - free_inodes.size();
+}
+
+void inode_table::clear() {
+   DEBUGF ('i', "releasing " << size() << " inodes");
+   inodes.clear();
+   files.clear();
+   dirs.clear();
+   free_inodes.clear();
+   free_files.clear();
+   free_dirs.clear();
+   dentry_cache::clear();
+   checkpoints::forget_all();
+}
+
+/*** FILESYSTEM IMAGE ***/
+// The magic string ends with the format version, which must change
+// whenever the layout of any of the structs below does.
+static constexpr char IMAGE_MAGIC[8] {'Y','S','H','I','M','G','0','2'};
+static constexpr uint32_t IMAGE_BYTE_ORDER {0x01020304};
+
+struct image_header {
+   char magic[8];
+   uint32_t byte_order;
+   uint32_t root;
+   uint64_t slots;
+   uint64_t heap_size;
+};
+
+// type is 0 for a free slot, or 1 plus the file_type.  For a plain
+// file, data is the text; for a directory, it is an array of
+// image_dirent.
+struct image_inode {
+   uint32_t type;
+   uint32_t name_len;
+   uint64_t name_off;
+   uint64_t data_off;
+   uint64_t data_len;
+};
+
+struct image_dirent {
+   uint32_t node;
+   uint32_t name_len;
+   uint64_t name_off;
+};
+
+// Appends to the heap on an eight byte boundary, returning the offset.
+static uint64_t heap_put (string& heap, const void* data, size_t size) {
+   heap.resize ((heap.size() + 7) & ~size_t {7});
+   uint64_t offset = heap.size();
+   heap.append (static_cast<const char*> (data), size);
+   return offset;
+}
+
+void inode_table::save (const string& filename, inode_ptr root) {
+   vector<bool> reachable (inodes.size());
+   vector<inode_ptr> pending {root};
+   reachable[root.get_nr()] = true;
+   while (not pending.empty()) {
+      inode& node = *pending.back();
+      pending.pop_back();
+      if (node.type != file_type::DIRECTORY_TYPE) continue;
+      for (dirent_view child: node.dir().entries()) {
+         if (reachable[child.node.get_nr()]) continue;
+         reachable[child.node.get_nr()] = true;
+         pending.push_back (child.node);
+      }
+   }
+
+   vector<image_inode> records (inodes.size());
+   string heap;
+   vector<image_dirent> entries;
+   for (size_t nr = 1; nr < inodes.size(); ++nr) {
+      const inode& node = inodes[nr];
+      image_inode& record = records[nr];
+      if (node.contents == nullptr or not reachable[nr]) continue;
+      record.type = 1 + static_cast<uint32_t> (node.type);
+      record.name_len = node.name.size();
+      record.name_off = heap_put (heap, node.name.data(),
+                                  node.name.size());
+      if (node.type == file_type::PLAIN_TYPE) {
+         const file_text& text = static_cast<plain_file*> (
+                                 node.contents)->current();
+         record.data_len = text.data.size();
+         record.data_off = heap_put (heap, text.data.data(),
+                                     text.data.size());
+      } else {
+         const directory& dir = *static_cast<directory*> (
+                                node.contents);
+         entries.clear();
+         for (const auto& dirent: dir.dirents) {
+            entries.push_back ({
+               static_cast<uint32_t> (dirent.node.get_nr()),
+               static_cast<uint32_t> (dirent.name.size()),
+               heap_put (heap, dirent.name.data(), dirent.name.size()),
+            });
+         }
+         record.data_len = entries.size();
+         record.data_off = heap_put (heap, entries.data(),
+                           entries.size() * sizeof (image_dirent));
+      }
+   }
+
+   image_header header {};
+   memcpy (header.magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC);
+   header.byte_order = IMAGE_BYTE_ORDER;
+   header.root = root.get_nr();
+   header.slots = records.size();
+   header.heap_size = heap.size();
+
+   string tempname = filename + ".tmp";
+   ofstream out (tempname, ios::binary | ios::trunc);
+   out.write (reinterpret_cast<const char*> (&header), sizeof header);
+   out.write (reinterpret_cast<const char*> (records.data()),
+              records.size() * sizeof (image_inode));
+   out.write (heap.data(), heap.size());
+   out.close();
+   if (not out or rename (tempname.c_str(), filename.c_str()) != 0) {
+      int error = errno;
+      unlink (tempname.c_str());
+      throw file_error (filename + ": " + strerror (error));
+   }
+   DEBUGF ('i', filename << ": " << records.size() << " slots, "
+           << heap.size() << " heap bytes");
+}
+
+// Checks that a heap reference lies within the heap.
+static const char* heap_get (const char* heap, uint64_t heap_size,
+                             uint64_t offset, uint64_t size) {
+   if (offset > heap_size or size > heap_size - offset) {
+      throw file_error ("image heap reference out of bounds");
+   }
+   return heap + offset;
+}
+
+// Builds the new table in locals and only swaps it in once the whole
+// image has been checked, so a bad image leaves the table alone.
+void inode_table::load_mapped (const char* image, size_t image_size,
+                               deque<inode>& new_inodes,
+                               deque<plain_file>& new_files,
+                               deque<directory>& new_dirs,
+                               vector<int>& new_free_inodes,
+                               int& root) {
+   image_header header;
+   if (image_size < sizeof header) throw file_error ("image truncated");
+   memcpy (&header, image, sizeof header);
+   if (memcmp (header.magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC) != 0
+       or header.byte_order != IMAGE_BYTE_ORDER) {
+      throw file_error ("not a filesystem image of this version");
+   }
+   size_t records_size = header.slots * sizeof (image_inode);
+   if (header.slots == 0 or header.slots > INT32_MAX
+       or records_size / sizeof (image_inode) != header.slots
+       or image_size - sizeof header < records_size
+       or image_size - sizeof header - records_size
+          != header.heap_size) {
+      throw file_error ("image truncated");
+   }
+   const image_inode* records = reinterpret_cast<const image_inode*> (
+                                image + sizeof header);
+   const char* heap = image + sizeof header + records_size;
+   uint64_t heap_size = header.heap_size;
+   auto is_directory = [&] (uint64_t nr) {
+      return nr > 0 and nr < header.slots
+         and records[nr].type
+             == 1 + static_cast<uint32_t> (file_type::DIRECTORY_TYPE);
+   };
+   if (not is_directory (header.root)) {
+      throw file_error ("image has no root directory");
+   }
+   root = header.root;
+
+   new_inodes.emplace_back (0, file_type::PLAIN_TYPE, "", nullptr);
+   for (uint64_t nr = 1; nr < header.slots; ++nr) {
+      const image_inode& record = records[nr];
+      if (record.type == 0) {
+         new_inodes.emplace_back (nr, file_type::PLAIN_TYPE, "",
+                                  nullptr);
+         new_free_inodes.push_back (nr);
+         continue;
+      }
+      string name (heap_get (heap, heap_size, record.name_off,
+                             record.name_len), record.name_len);
+      if (record.type == 1 + static_cast<uint32_t> (
+                             file_type::PLAIN_TYPE)) {
+         new_files.emplace_back();
+         plain_file& file = new_files.back();
+         if (record.data_len > 0) {
+            file.text = make_shared<file_text>();
+            file_text& text = *file.text;
+            text.data.assign (heap_get (heap, heap_size,
+                              record.data_off, record.data_len),
+                              record.data_len);
+         }
+         new_inodes.emplace_back (nr, file_type::PLAIN_TYPE, name,
+                                  &file);
+      } else if (is_directory (nr)) {
+         new_dirs.emplace_back();
+         directory& dir = new_dirs.back();
+         if (record.data_len > heap_size / sizeof (image_dirent)) {
+            throw file_error ("image heap reference out of bounds");
+         }
+         const char* entries = heap_get (heap, heap_size,
+                               record.data_off,
+                               record.data_len * sizeof (image_dirent));
+         for (uint64_t entry = 0; entry < record.data_len; ++entry) {
+            image_dirent dirent;
+            memcpy (&dirent, entries + entry * sizeof dirent,
+                    sizeof dirent);
+            if (dirent.node == 0 or dirent.node >= header.slots
+                or records[dirent.node].type == 0) {
+               throw file_error ("image has a dangling dirent");
+            }
+            file_type type = static_cast<file_type> (
+                             records[dirent.node].type - 1);
+            dir.setdir (string (heap_get (heap, heap_size,
+                                dirent.name_off, dirent.name_len),
+                                dirent.name_len),
+                        inode_ptr (dirent.node), type);
+         }
+         if (dir.lookup (".") != inode_ptr (nr)
+             or not is_directory (dir.lookup ("..").get_nr())) {
+            throw file_error ("image has a directory without . or ..");
+         }
+         new_inodes.emplace_back (nr, file_type::DIRECTORY_TYPE, name,
+                              &dir);
+      } else {
+         throw file_error ("image has an inode of unknown type");
+      }
+   }
+}
+
+inode_ptr inode_table::load (const string& filename) {
+   int fd = open (filename.c_str(), O_RDONLY);
+   if (fd < 0) throw file_error (filename + ": " + strerror (errno));
+   struct stat info;
+   if (fstat (fd, &info) != 0 or info.st_size == 0) {
+      close (fd);
+      throw file_error (filename + ": not a filesystem image");
+   }
+   size_t image_size = info.st_size;
+   void* image = mmap (nullptr, image_size, PROT_READ, MAP_PRIVATE,
+                       fd, 0);
+   close (fd);
+   if (image == MAP_FAILED) {
+      throw file_error (filename + ": " + strerror (errno));
+   }
+   madvise (image, image_size, MADV_SEQUENTIAL);
+
+   deque<inode> new_inodes;
+   deque<plain_file> new_files;
+   deque<directory> new_dirs;
+   vector<int> new_free_inodes;
+   int root = 0;
+   try {
+      load_mapped (static_cast<const char*> (image), image_size,
+                   new_inodes, new_files, new_dirs, new_free_inodes,
+                   root);
+   }catch (file_error& error) {
+      munmap (image, image_size);
+      throw file_error (filename + ": " + error.what());
+   }
+   munmap (image, image_size);
+
+   clear();
+   inodes.swap (new_inodes);
+   files.swap (new_files);
+   dirs.swap (new_dirs);
+   free_inodes.swap (new_free_inodes);
+   rebuild_totals (inode_ptr (root));
+   DEBUGF ('i', filename << ": " << inodes.size() << " slots");
+   return inode_ptr (root);
+}
+
+// Sets the parent of every inode reachable from the root, then adds
+// up the subtree_totals from the leaves upward.  Works from a list
+// rather than recursively, so deep trees cannot exhaust the stack,
+// and never visits an inode twice, whatever the image holds.
+void inode_table::rebuild_totals (inode_ptr root) {
+   vector<bool> seen (inodes.size());
+   vector<inode_ptr> nodes {root};
+   seen[root.get_nr()] = true;
+   for (size_t next = 0; next < nodes.size(); ++next) {
+      inode& node = *nodes[next];
+      if (node.type != file_type::DIRECTORY_TYPE) continue;
+      node.dir().below = subtree_totals();
+      for (dirent_view child: node.dir().entries()) {
+         if (child.name == "." or child.name == "..") continue;
+         if (seen[child.node.get_nr()]) continue;
+         seen[child.node.get_nr()] = true;
+         child.node->parent = nodes[next];
+         nodes.push_back (child.node);
+      }
+   }
+   for (size_t next = nodes.size(); next-- > 1;) {
+      inode& node = *nodes[next];
+      node.parent->dir().below += node.totals();
+   }
+}
+
+/*** CHECKPOINTS ***/
+map<int,inode_ptr> checkpoints::saved;
+int checkpoints::last_id {0};
+
+int checkpoints::take (inode_ptr root) {
+   saved.emplace (++last_id, inode_table::clone_tree (root));
+   DEBUGF ('i', "checkpoint " << last_id << " of " << root);
+   return last_id;
+}
+
+// The root is emptied and refilled rather than replaced, so it
+// keeps its inode number.  The names are copied out first, since
+// detaching changes the directory being iterated over.
+void checkpoints::restore (int id, inode_ptr root) {
+   auto version = saved.find (id);
+   if (version == saved.end()) {
+      throw file_error ("no checkpoint " + to_string (id));
+   }
+   vector<string> names;
+   for (dirent_view child: root->children()) {
+      if (child.name == "." or child.name == "..") continue;
+      names.emplace_back (child.name);
+   }
+   for (const string& name: names) {
+      inode_table::release_tree (root->detach (name));
+   }
+   for (dirent_view child: version->second->children()) {
+      if (child.name == "." or child.name == "..") continue;
+      root->attach (string (child.name),
+                    inode_table::clone_tree (child.node));
+   }
+}
+
+bool checkpoints::release (int id) {
+   auto version = saved.find (id);
+   if (version == saved.end()) return false;
+   inode_table::release_tree (version->second);
+   saved.erase (version);
+   return true;
+}
+
+void checkpoints::release_all() {
+   for (const auto& version: saved) {
+      inode_table::release_tree (version.second);
+   }
+   saved.clear();
+}
+
+void checkpoints::forget_all() {
+   saved.clear();
+   last_id = 0;
+}
+
+const map<int,inode_ptr>& checkpoints::versions() {
+   return saved;
+}
+
+/*** DENTRY CACHE ***/
+unordered_map<string,inode_ptr> dentry_cache::entries;
+unordered_multimap<int,const string*> dentry_cache::keys_by_inode;
+shared_mutex dentry_cache::guard;
+atomic<size_t> dentry_cache::hit_count {0};
+atomic<size_t> dentry_cache::miss_count {0};
+
+inode_ptr dentry_cache::lookup (const string& key) {
+   shared_lock<shared_mutex> reading (guard);
+   auto it = entries.find (key);
+   if (it == entries.end()) {
+      miss_count.fetch_add (1, memory_order_relaxed);
+      return nullptr;
+   }
+   hit_count.fetch_add (1, memory_order_relaxed);
+   return it->second;
+}
+
+void dentry_cache::insert (const string& key, inode_ptr dir) {
+   lock_guard<shared_mutex> writing (guard);
+   // Rather than track recency, start over when the cache fills up.
+   if (entries.size() >= MAX_ENTRIES) clear_locked();
+   auto inserted = entries.emplace (key, dir);
+   if (inserted.second) {
+      keys_by_inode.emplace (dir.get_nr(), &inserted.first->first);
+   }
+}
+
+void dentry_cache::forget (inode_ptr node) {
+   lock_guard<shared_mutex> writing (guard);
+   auto range = keys_by_inode.equal_range (node.get_nr());
+   if (range.first == range.second) return;
+   for (auto it = range.first; it != range.second; ++it) {
+      string key = *it->second;
+      entries.erase (key);
+   }
+   keys_by_inode.erase (range.first, range.second);
+}
+
+void dentry_cache::clear_locked() {
+   entries.clear();
+   keys_by_inode.clear();
+}
+
+void dentry_cache::clear() {
+   lock_guard<shared_mutex> writing (guard);
+   clear_locked();
+}
+
+size_t dentry_cache::size() {
+   shared_lock<shared_mutex> reading (guard);
+   return entries.size();
+}
+
+size_t dentry_cache::hits() {
+   return hit_count.load (memory_order_relaxed);
+}
+
+size_t dentry_cache::misses() {
+   return miss_count.load (memory_order_relaxed);
+}
+
 /*** INODE STATE ***/
+mutex inode_state::sharing_lock;
+vector<inode_state*> inode_state::sharing;
+
 inode_state::inode_state() {
    // We use an empty string to identify the root directory.
-   inode root_file(file_type::DIRECTORY_TYPE, "");
-   root = make_shared<inode>(root_file);
+   root = inode_table::alloc (file_type::DIRECTORY_TYPE, "");
    cwd = root;
 
-   // Configure the parent and root dirs
-   root_file.set_root(root);
-   root_file.set_parent(root);
+   // The root is its own parent.
+   root->set_root (root);
+   root->set_parent (root);
+   share();
 
    DEBUGF ('i', "root = " << root << ", cwd = " << cwd
           << ", prompt = \"" << prompt() << "\"");
 }
 
+inode_state::inode_state (inode_ptr shared_root):
+             root (shared_root), cwd (shared_root) {
+   share();
+   DEBUGF ('i', "root = " << root << " shared");
+}
+
+inode_state::~inode_state() {
+   lock_guard<mutex> guard (sharing_lock);
+   sharing.erase (find (sharing.begin(), sharing.end(), this));
+}
+
+void inode_state::share() {
+   lock_guard<mutex> guard (sharing_lock);
+   sharing.push_back (this);
+}
+
 const string& inode_state::prompt() { return prompt_; }
 
+ostream& inode_state::output() { return *out; }
+
+void inode_state::set_output (ostream& new_output) {
+   out = &new_output;
+}
+
 inode_ptr inode_state::current_dir() {
    return cwd;
 }
@@ -58,31 +654,176 @@ void inode_state::set_directory(inode_ptr new_directory) {
    cwd = new_directory;
 }
 
+void inode_state::reset (inode_ptr new_root) {
+   lock_guard<mutex> guard (sharing_lock);
+   inode_ptr old_root = root;
+   for (inode_state* state: sharing) {
+      if (state->root != old_root) continue;
+      state->root = new_root;
+      state->cwd = new_root;
+   }
+}
+
+const string& inode_state::current_path() {
+   return cwd->get_path();
+}
+
+// The current directory is compared before its parent is followed,
+// so a state whose cwd is top itself is moved even if top has already
+// been released.
+void inode_state::leave_subtree (inode_ptr top, inode_ptr refuge) {
+   lock_guard<mutex> guard (sharing_lock);
+   for (inode_state* state: sharing) {
+      if (state->root != root) continue;
+      for (inode_ptr node = state->cwd; node; node = node->parent) {
+         if (node == top) {
+            state->cwd = refuge;
+            break;
+         }
+      }
+   }
+}
+
+// Splits a path into the directory part, including its trailing
+// slash, and the last component.  The leaf is empty if the path has
+// no components at all.
+static void split_leaf (string_view path, string_view& prefix,
+                        string_view& leaf) {
+   size_t last = path.find_last_not_of ('/');
+   if (last == string_view::npos) {
+      prefix = path;
+      leaf = string_view();
+      return;
+   }
+   size_t slash = path.find_last_of ('/', last);
+   size_t start = slash == string_view::npos ? 0 : slash + 1;
+   prefix = path.substr (0, start);
+   leaf = path.substr (start, last + 1 - start);
+}
+
+path_status inode_state::walk (inode_ptr base, string_view path,
+                               inode_ptr& node) {
+   inode_ptr pos = base;
+   size_t end = 0;
+   for (;;) {
+      size_t start = skip_delimiters (path, end, SLASH);
+      if (start == string_view::npos) break;
+      end = find_delimiter (path, start, SLASH);
+      string_view name = path.substr (start, end - start);
+      if (pos->type != file_type::DIRECTORY_TYPE) {
+         return path_status::NOT_A_DIRECTORY;
+      }
+      if (name == ".") continue;
+      pos = pos->dir().lookup (name);
+      if (not pos) return path_status::NOT_FOUND;
+   }
+   node = pos;
+   return path_status::OK;
+}
+
+path_status inode_state::resolve_dir (inode_ptr base, string_view path,
+                                      inode_ptr& dir) {
+   // Build the normalized key, giving up on caching if the path
+   // climbs through "..".
+   path_key.assign (to_string (base.get_nr()));
+   bool cacheable = true;
+   size_t depth = 0;
+   size_t end = 0;
+   for (;;) {
+      size_t start = skip_delimiters (path, end, SLASH);
+      if (start == string_view::npos) break;
+      end = find_delimiter (path, start, SLASH);
+      string_view name = path.substr (start, end - start);
+      if (name == ".") continue;
+      if (name == "..") cacheable = false;
+      path_key += '/';
+      path_key.append (name.data(), name.size());
+      ++depth;
+   }
+   if (depth == 0) {
+      dir = base;
+      return path_status::OK;
+   }
+   if (cacheable) {
+      dir = dentry_cache::lookup (path_key);
+      stats::record_path (depth, bool (dir));
+      if (dir) return path_status::OK;
+   } else stats::record_path (depth, false);
+
+   path_status status = walk (base, path, dir);
+   if (status != path_status::OK) return status;
+   if (dir->type != file_type::DIRECTORY_TYPE) {
+      return path_status::NOT_A_DIRECTORY;
+   }
+   if (cacheable) dentry_cache::insert (path_key, dir);
+   return path_status::OK;
+}
+
+path_status inode_state::resolve (string_view path, inode_ptr& node) {
+   inode_ptr base = (not path.empty() and path.front() == '/')
+                  ? root : cwd;
+   string_view prefix;
+   string_view leaf;
+   split_leaf (path, prefix, leaf);
+   if (leaf.empty()) {
+      node = base;
+      return path_status::OK;
+   }
+
+   inode_ptr dir;
+   path_status status = resolve_dir (base, prefix, dir);
+   if (status != path_status::OK) return status;
+   if (leaf == ".") {
+      node = dir;
+      return path_status::OK;
+   }
+   node = dir->dir().lookup (leaf);
+   if (not node) return path_status::NOT_FOUND;
+   return path_status::OK;
+}
+
+path_status inode_state::resolve_parent (string_view path,
+                                         inode_ptr& dir,
+                                         string_view& leaf) {
+   inode_ptr base = (not path.empty() and path.front() == '/')
+                  ? root : cwd;
+   string_view prefix;
+   split_leaf (path, prefix, leaf);
+   if (leaf.empty()) return path_status::NO_NAME;
+   return resolve_dir (base, prefix, dir);
+}
+
 ostream& operator<< (ostream& out, const inode_state& state) {
    out << "inode_state: root = " << state.root
-       << ", cwd = " << state.cwd;
+       << ", cwd = " << state.cwd
+       << ", dentry cache hits = " << dentry_cache::hits()
+       << ", misses = " << dentry_cache::misses();
    return out;
 }
 
 /*** INODE ***/
-inode::inode(file_type f_type, string inode_name):
-       inode_nr (next_inode_nr++) {
-   type = f_type;
-   name = inode_name;
+inode::inode (int nr, file_type f_type, const string& inode_name,
+              base_file* inode_contents):
+       inode_nr (nr), type (f_type), contents (inode_contents),
+       name (inode_name), parent (nullptr) {
+}
 
-   switch (type) {
-      case file_type::PLAIN_TYPE:
-           contents = make_shared<plain_file>();
-           break;
-      case file_type::DIRECTORY_TYPE:
-           contents = make_shared<directory>();
-           break;
+directory& inode::dir() {
+   if (type == file_type::PLAIN_TYPE) {
+      throw file_error ("is a plain file");
    }
-   DEBUGF ('i', "inode " << inode_nr << ", type = " << type);
+   return *static_cast<directory*> (contents);
+}
+
+plain_file& inode::file() {
+   if (type == file_type::DIRECTORY_TYPE) {
+      throw file_error ("is a directory");
+   }
+   return *static_cast<plain_file*> (contents);
 }
 
 int inode::get_inode_nr() const {
-   DEBUGF ('i', "inode = " << inode_nr);
+   TRACE ('i', "inode", inode_nr);
    return inode_nr;
 }
 
@@ -91,78 +832,171 @@ file_type inode::get_file_type() {
 }
 
 inode_ptr inode::get_child_directory(string name) {
-   return dynamic_pointer_cast<directory>(contents) ->
-                                    get_dirent(name);
+   return dir().get_dirent(name);
+}
+
+inode_ptr inode::lookup (string_view name) {
+   return dir().lookup (name);
+}
+
+dirent_range inode::children() {
+   return dir().entries();
 }
 
-wordvec inode::get_child_names() {
-   return dynamic_pointer_cast<directory>(contents) ->
-                                    get_content_labels();
+dirent_range inode::sorted_children() {
+   return dir().sorted_entries();
 }
 
 int inode::size() {
    return contents->size();
 }
 
+subtree_totals inode::totals() {
+   if (type == file_type::PLAIN_TYPE) {
+      return {1, 0, static_cast<int64_t> (file().size())};
+   }
+   subtree_totals totals = dir().below;
+   ++totals.dirs;
+   return totals;
+}
+
+// Walks up to the nearest directory that already knows its path,
+// then fills in the paths on the way back down.  Paths are built
+// under lazy_lock, since readers in different sessions may build
+// them at once, and each is published by setting path_valid.
+static mutex lazy_lock;
+
+const string& inode::get_path() {
+   if (dir().path_valid.load (memory_order_acquire)) return dir().path;
+   lock_guard<mutex> guard (lazy_lock);
+   vector<inode*> missing;
+   inode* node = this;
+   while (not node->dir().path_valid and node->parent) {
+      missing.push_back (node);
+      node = &*node->parent;
+   }
+   if (not node->dir().path_valid) {
+      node->dir().path = "/";
+      node->dir().path_valid.store (true, memory_order_release);
+   }
+   for (auto child = missing.rbegin(); child != missing.rend(); ++child) {
+      const string& above = (*child)->parent->dir().path;
+      string& path = (*child)->dir().path;
+      path.reserve (above.size() + 1 + (*child)->name.size());
+      path = above;
+      if (above.size() > 1) path += '/';
+      path += (*child)->name;
+      (*child)->dir().path_valid.store (true, memory_order_release);
+   }
+   return dir().path;
+}
+
+// Applies a change below this directory to it and every directory
+// above it, which is O(depth).
+void inode::add_totals (const subtree_totals& delta) {
+   for (inode* node = this;; node = &*node->parent) {
+      node->dir().below += delta;
+      if (not node->parent) break;
+   }
+}
+
 string inode::get_name() {
    return name;
 }
 
 void inode::set_root(inode_ptr new_root) {
-   if (type == file_type::PLAIN_TYPE) {
-      throw file_error ("is a plain file");
-   }
-
-   dynamic_pointer_cast<directory>(contents) -> setdir(string("."),
-                                                       new_root);
+   dir().setdir(string("."), new_root);
 }
 
 void inode::set_parent(inode_ptr new_parent) {
-   if (type == file_type::PLAIN_TYPE) {
-      throw file_error ("is a plain file");
-   }
-
-   dynamic_pointer_cast<directory>(contents) -> setdir(string(".."),
-                                                       new_parent);
+   dir().setdir(string(".."), new_parent);
 }
 
 inode_ptr inode::get_parent() {
-   if (type == file_type::PLAIN_TYPE) {
-      throw file_error ("is a plain file");
-   }
+   return dir().get_dirent("..");
+}
 
-   return dynamic_pointer_cast<directory>(contents) -> get_dirent("..");
+string_view inode::readfile() {
+   return contents->readfile();
 }
 
-void inode::writefile(const wordvec& file_data) {
+void inode::writefile(string&& file_data) {
    if (type == file_type::DIRECTORY_TYPE) {
       throw file_error ("cannot write to directory");
    }
 
-   dynamic_pointer_cast<plain_file>(contents) -> writefile(file_data);
+   int64_t old_size = file().size();
+   file().writefile(move(file_data));
+   if (parent) {
+      parent->add_totals ({0, 0, static_cast<int64_t> (file().size())
+                                 - old_size});
+   }
+}
+
+void inode::writefile (file_text&& text) {
+   if (type == file_type::DIRECTORY_TYPE) {
+      throw file_error ("cannot write to directory");
+   }
+   int64_t old_size = file().size();
+   file().writefile (move (text));
+   if (parent) {
+      parent->add_totals ({0, 0, static_cast<int64_t> (file().size())
+                                 - old_size});
+   }
 }
 
 inode_ptr inode::make_dir(string name) {
-   inode_ptr new_dir = dynamic_pointer_cast<directory>(contents) ->
-                                                       mkdir(name);
-   new_dir -> set_parent(make_shared<inode>(*this));
-   return new_dir;
+   inode_ptr child = dir().mkdir(name);
+   child->parent = inode_ptr (inode_nr);
+   add_totals ({0, 1, 0});
+   return child;
 }
 
 inode_ptr inode::make_file(string name) {
-   return dynamic_pointer_cast<directory>(contents) -> mkfile(name);
+   inode_ptr existing = dir().lookup(name);
+   if (existing) return existing;
+   inode_ptr child = dir().mkfile(name);
+   child->parent = inode_ptr (inode_nr);
+   add_totals ({1, 0, 0});
+   return child;
 }
 
 void inode::remove(string name) {
-   contents -> remove(name);
+   if (type == file_type::PLAIN_TYPE) contents -> remove(name);
+   inode_ptr child = dir().lookup(name);
+   subtree_totals removed = child ? child->totals() : subtree_totals();
+   dir().remove(name);
+   add_totals (-removed);
 }
 
-ostream& operator<< (ostream& out, inode& node) {
-   if (node.type == file_type::DIRECTORY_TYPE) {
-      out << "/" << node.name << ":" << endl;
-      out << *dynamic_pointer_cast<directory>(node.contents);
-   } else out << *dynamic_pointer_cast<plain_file>(node.contents);
+inode_ptr inode::detach (const string& name) {
+   inode_ptr child = dir().detach (name);
+   add_totals (-child->totals());
+   child->parent = nullptr;
+   return child;
+}
 
+void inode::attach (const string& name, inode_ptr subtree) {
+   if (dir().lookup (name)) throw file_error (name + " already exists");
+   dir().insert (name, subtree, subtree->type);
+   stats::record_dir_size (dir().dirents.size());
+   subtree->name = name;
+   subtree->parent = inode_ptr (inode_nr);
+   if (subtree->type == file_type::DIRECTORY_TYPE) {
+      subtree->set_parent (subtree->parent);
+   }
+   add_totals (subtree->totals());
+}
+
+void inode::print (ostream& out, bool subtree_sizes) {
+   if (type == file_type::DIRECTORY_TYPE) {
+      out << "/" << name << ":\n";
+      dir().print (out, subtree_sizes);
+   } else out << file();
+}
+
+ostream& operator<< (ostream& out, inode& node) {
+   node.print (out, false);
    return out;
 }
 
@@ -178,26 +1012,58 @@ ostream& operator<< (ostream& out, const base_file&) {
 
 /*** PLAIN FILE ***/
 ostream& operator<< (ostream& out, const plain_file& file) {
-   out << file.data;
+   const string& data = file.current().data;
+   out.write (data.data(), data.size());
    return out;
 }
 
+const file_text plain_file::EMPTY_TEXT;
+
 plain_file::plain_file() {}
 
+// Empties a file so the inode_table can hand it out again, giving
+// back the memory of large ones unless another file shares it.
+void plain_file::clear() {
+   text.reset();
+}
+
+void plain_file::share (const plain_file& that) {
+   text = that.text;
+}
+
 size_t plain_file::size() const {
-   size_t size {data.size()}; // incomplete, needs to factor in spaces
-   DEBUGF ('i', "size = " << size);
+   size_t size {current().data.size()};
+   TRACE ('i', "size", size);
    return size;
 }
 
-const wordvec& plain_file::readfile() const {
-   DEBUGF ('i', data);
+string_view plain_file::readfile() const {
+   const string& data = current().data;
+   TRACE ('i', "readfile bytes", data.size());
    return data;
 }
 
-void plain_file::writefile (const wordvec& words) {
-   DEBUGF ('i', words);
-   data = words;
+void plain_file::writefile (string&& newdata) {
+   TRACE ('i', "writefile bytes", newdata.size());
+   stats::record_write (newdata.size());
+   if (newdata.empty()) {
+      text.reset();
+      return;
+   }
+   if (text == nullptr or text.use_count() > 1) {
+      text = make_shared<file_text>();
+   }
+   text->data = move (newdata);
+}
+
+void plain_file::writefile (file_text&& newtext) {
+   TRACE ('i', "writefile bytes", newtext.data.size());
+   stats::record_write (newtext.data.size());
+   if (newtext.data.empty()) {
+      text.reset();
+      return;
+   }
+   text = make_shared<file_text> (move (newtext));
 }
 
 void plain_file::remove (const string&) {
@@ -213,101 +1079,202 @@ inode_ptr plain_file::mkfile (const string&) {
 }
 
 /*** DIRECTORY ***/
-// A handy helper-function to determine who many digits wide a positive
-// number is.
-int get_digit_width(int number) {
-   int width = 1;
-   if (number >= 0) {
-      while (number > 10) {
-         number = number / 10;
-         width++;
+ostream& operator<< (ostream& out, const directory& dir) {
+   dir.print (out, false);
+   return out;
+}
+
+// Each line is formatted into a local buffer and written at once:
+// inode number and size right-aligned in five columns, then the name,
+// with a slash after subdirectories.
+void directory::print (ostream& out, bool subtree_sizes) const {
+   constexpr size_t COLUMN_WIDTH {5};
+   constexpr size_t NUMBER_CHARS {24};
+   char columns[2 * NUMBER_CHARS];
+   char* end = columns + sizeof columns;
+   for (dirent_view dirent: sorted_entries()) {
+      // Columns 1 and 2 (inode number and size), filled in from the
+      // right:
+      size_t size = subtree_sizes ? dirent.node->totals().bytes
+                                  : dirent.node->size();
+      char* first = end;
+      *--first = ' ';
+      *--first = ' ';
+      first = format_padded (first, size, COLUMN_WIDTH);
+      *--first = ' ';
+      *--first = ' ';
+      first = format_padded (first, dirent.node->get_inode_nr(),
+                             COLUMN_WIDTH);
+      out.write (first, end - first);
+
+      // Column 3 (name):
+      out.write (dirent.name.data(), dirent.name.size());
+      if (dirent.type == file_type::DIRECTORY_TYPE
+         and !(dirent.name == "." or dirent.name == "..")) {
+         out.put ('/');
       }
+      out.put ('\n');
    }
-
-   return width;
 }
 
-ostream& operator<< (ostream& out, const directory& dir) {
-   for (map<string,inode_ptr>::const_iterator it = dir.dirents.begin();
-        it != dir.dirents.end();
-        ++it) {
-      // Print column 1 (inode number):
-      int inode_number = it->second->get_inode_nr();
-      int column_one_width = 5 - get_digit_width(inode_number);
-
-      while (column_one_width > 0) {
-         out << " ";
-         column_one_width--;
-      }
-      out << inode_number;
+directory::directory() {
+   insert(".", nullptr, file_type::DIRECTORY_TYPE);
+   insert("..", nullptr, file_type::DIRECTORY_TYPE);
+}
 
-      out << "  ";
+directory::directory(inode_ptr root, inode_ptr parent) {
+   insert(".", root, file_type::DIRECTORY_TYPE);
+   insert("..", parent, file_type::DIRECTORY_TYPE);
+}
 
-      // Print column 2 (size):
-      int size = it->second->size();
-      int column_two_width = 5 - get_digit_width(size);
+// Empties a directory so the inode_table can hand it out again.
+// The tables are swapped out rather than cleared, so a large
+// directory gives its storage back instead of keeping it on the
+// free list.
+void directory::clear() {
+   below = subtree_totals();
+   string().swap (path);
+   path_valid = false;
+   vector<dirent>().swap (dirents);
+   vector<int>().swap (index);
+   vector<int>().swap (sorted);
+   sorted_valid = false;
+   insert(".", nullptr, file_type::DIRECTORY_TYPE);
+   insert("..", nullptr, file_type::DIRECTORY_TYPE);
+}
 
-      while (column_two_width > 0) {
-         out << " ";
-         column_two_width--;
+// Returns the position in dirents of the entry with the given name,
+// or EMPTY if there is none.
+int directory::find (string_view name, size_t hash) const {
+   if (index.empty()) {
+      for (size_t entry = 0; entry < dirents.size(); ++entry) {
+         if (dirents[entry].hash == hash
+             and dirents[entry].name == name) return entry;
       }
-      out << size;
-
-      out << "  ";
-
-      // Print column 3 (name):
-      out << it->first;
-      if (it->second->get_file_type() == file_type::DIRECTORY_TYPE
-         and !(it->first == "." or it->first == "..")) {
-         out << "/";
+      return EMPTY;
+   }
+   size_t mask = index.size() - 1;
+   for (size_t bucket = hash & mask; index[bucket] != EMPTY;
+        bucket = (bucket + 1) & mask) {
+      const dirent& candidate = dirents[index[bucket]];
+      if (candidate.hash == hash and candidate.name == name) {
+         return index[bucket];
       }
+   }
+   return EMPTY;
+}
 
-      if (it != dir.dirents.end()) out << endl;
+// Returns the bucket in the index holding the given entry, which
+// must be present.
+size_t directory::find_bucket (int entry) const {
+   size_t mask = index.size() - 1;
+   size_t bucket = dirents[entry].hash & mask;
+   while (index[bucket] != entry) bucket = (bucket + 1) & mask;
+   return bucket;
+}
+
+void directory::rehash (size_t buckets) {
+   index.assign (buckets, EMPTY);
+   size_t mask = buckets - 1;
+   for (size_t entry = 0; entry < dirents.size(); ++entry) {
+      size_t bucket = dirents[entry].hash & mask;
+      while (index[bucket] != EMPTY) bucket = (bucket + 1) & mask;
+      index[bucket] = entry;
    }
-   return out;
 }
 
-directory::directory() {
-   dirents.insert(pair<string,inode_ptr>(".", nullptr));
-   dirents.insert(pair<string,inode_ptr>("..", nullptr));
+void directory::insert (const string& name, inode_ptr node,
+                        file_type type) {
+   dirents.push_back ({name, hash<string_view>{} (name), node, type});
+   sorted_valid = false;
+
+   // Promote to a hashed index once the directory stops being small,
+   // and keep the load factor at or below one half after that.
+   if (index.empty()) {
+      if (dirents.size() > SMALL_DIR) rehash (4 * SMALL_DIR);
+      return;
+   }
+   if (2 * dirents.size() > index.size()) {
+      rehash (2 * index.size());
+      return;
+   }
+   size_t mask = index.size() - 1;
+   size_t bucket = dirents.back().hash & mask;
+   while (index[bucket] != EMPTY) bucket = (bucket + 1) & mask;
+   index[bucket] = dirents.size() - 1;
 }
 
-directory::directory(inode_ptr root, inode_ptr parent) {
-   dirents.insert(pair<string,inode_ptr>(".", root));
-   dirents.insert(pair<string,inode_ptr>("..", parent));
+void directory::erase (int entry) {
+   sorted_valid = false;
+   int last = dirents.size() - 1;
+   if (not index.empty()) {
+      // Backward shift deletion: pull later members of the probe
+      // run into the hole so that lookups never need tombstones.
+      size_t mask = index.size() - 1;
+      size_t hole = find_bucket (entry);
+      size_t bucket = hole;
+      for (;;) {
+         bucket = (bucket + 1) & mask;
+         if (index[bucket] == EMPTY) break;
+         size_t home = dirents[index[bucket]].hash & mask;
+         if (((bucket - home) & mask) >= ((bucket - hole) & mask)) {
+            index[hole] = index[bucket];
+            hole = bucket;
+         }
+      }
+      index[hole] = EMPTY;
 
+      // The last entry moves into the vacated slot.
+      if (entry != last) index[find_bucket (last)] = entry;
+   }
+   if (entry != last) dirents[entry] = move (dirents[last]);
+   dirents.pop_back();
+}
+
+const vector<int>& directory::sorted_dirents() const {
+   if (sorted_valid.load (memory_order_acquire)) return sorted;
+   lock_guard<mutex> guard (lazy_lock);
+   if (not sorted_valid.load (memory_order_relaxed)) {
+      sorted.resize (dirents.size());
+      for (size_t entry = 0; entry < dirents.size(); ++entry) {
+         sorted[entry] = entry;
+      }
+      sort (sorted.begin(), sorted.end(), [this] (int a, int b) {
+         return dirents[a].name < dirents[b].name;
+      });
+      sorted_valid.store (true, memory_order_release);
+   }
+   return sorted;
 }
 
 size_t directory::size() const {
    size_t size = dirents.size();
-   DEBUGF ('i', "size = " << size);
+   TRACE ('i', "size", size);
    return size;
 }
 
-const wordvec& directory::readfile() const {
+string_view directory::readfile() const {
    throw file_error ("is a directory");
 }
 
-void directory::writefile (const wordvec&) {
+void directory::writefile (string&&) {
    throw file_error ("is a directory");
 }
 
 void directory::remove (const string& filename) {
    DEBUGF ('i', filename);
-   map<string,inode_ptr>::iterator it = dirents.find(filename);
-   if (it != dirents.end()) {
-      inode_ptr node_to_kill = dirents.at(filename);
+   int entry = find(filename, hash<string_view>{} (filename));
+   if (entry != EMPTY) {
+      inode_ptr node_to_kill = dirents[entry].node;
       if (node_to_kill->get_file_type() == file_type::DIRECTORY_TYPE) {
          if (node_to_kill -> size() > 2) {
             throw file_error (filename +
-                           "canot be removed because it is not empty");
+                           " cannot be removed because it is not empty");
          }
-
-         node_to_kill -> set_root(nullptr);
-         node_to_kill -> set_parent(nullptr);
       }
 
-      dirents.erase(it);
+      erase(entry);
+      inode_table::release(node_to_kill);
    } else {
       throw file_error (filename +
                        " cannot be removed because it does not exist");
@@ -317,16 +1284,16 @@ void directory::remove (const string& filename) {
 inode_ptr directory::mkdir (const string& dirname) {
    DEBUGF ('i', dirname);
 
-   map<string,inode_ptr>::iterator it = dirents.find(dirname);
-   if (it != dirents.end()) {
+   if (lookup(dirname)) {
       throw file_error (dirname + " already exists");
    }
 
-   inode new_directory(file_type::DIRECTORY_TYPE, dirname);
-   new_directory.set_root(dirents.at("."));
-
-   inode_ptr directory_ptr = make_shared<inode>(new_directory);
-   dirents.insert(pair<string,inode_ptr>(dirname, directory_ptr));
+   inode_ptr directory_ptr = inode_table::alloc(file_type::DIRECTORY_TYPE,
+                                                dirname);
+   directory_ptr -> set_root(directory_ptr);
+   directory_ptr -> set_parent(lookup("."));
+   insert(dirname, directory_ptr, file_type::DIRECTORY_TYPE);
+   stats::record_dir_size(dirents.size());
 
    return directory_ptr;
 }
@@ -334,42 +1301,62 @@ inode_ptr directory::mkdir (const string& dirname) {
 inode_ptr directory::mkfile (const string& filename) {
    DEBUGF ('i', filename);
 
-   map<string,inode_ptr>::iterator it = dirents.find(filename);
-   if (it != dirents.end()) {
-      return dirents.at(filename);
-   }
-
-   inode new_file(file_type::PLAIN_TYPE, filename);
+   inode_ptr existing = lookup(filename);
+   if (existing) return existing;
 
-   inode_ptr file_ptr = make_shared<inode>(new_file);
-   dirents.insert(pair<string,inode_ptr>(filename, file_ptr));
+   inode_ptr file_ptr = inode_table::alloc(file_type::PLAIN_TYPE,
+                                           filename);
+   insert(filename, file_ptr, file_type::PLAIN_TYPE);
+   stats::record_dir_size(dirents.size());
 
    return file_ptr;
 }
 
 // Updates the pointer of a given directory. If no such directory
-// exists, a new directory is created with the given pointer.
-void directory::setdir(string name, inode_ptr directory) {
-   map<string,inode_ptr>::iterator it = dirents.find(name);
-   if (it != dirents.end()) {
-      dirents.erase(name);
-   }
-
-   dirents.insert(pair<string,inode_ptr>(name, directory));
+// exists, a new directory is created with the given pointer.  Loading
+// an image also uses this for plain files, passing their type.
+void directory::setdir(string name, inode_ptr directory,
+                       file_type type) {
+   int entry = find(name, hash<string_view>{} (name));
+   if (entry != EMPTY) {
+      dirents[entry].node = directory;
+      dirents[entry].type = type;
+   } else insert(name, directory, type);
 }
 
 inode_ptr directory::get_dirent(string name) {
-   return dirents.at(name);
+   inode_ptr node = lookup(name);
+   if (not node) throw file_error (name + ": no such file or directory");
+   return node;
 }
 
-wordvec directory::get_content_labels() {
-   wordvec labels;
+inode_ptr directory::lookup (string_view name) const {
+   int entry = find (name, hash<string_view>{} (name));
+   if (entry == EMPTY) return nullptr;
+   return dirents[entry].node;
+}
 
-   for(map<string,inode_ptr>::iterator it = dirents.begin();
-       it != dirents.end();
-       ++it) {
-      labels.push_back(it->first);
+inode_ptr directory::detach (const string& name) {
+   DEBUGF ('i', name);
+   int entry = find (name, hash<string_view>{} (name));
+   if (entry == EMPTY) {
+      throw file_error (name +
+                       " cannot be removed because it does not exist");
    }
+   inode_ptr node = dirents[entry].node;
+   erase (entry);
+   return node;
+}
+
+dirent_range directory::entries() const {
+   return dirent_range (dirents.data(), nullptr, dirents.size());
+}
+
+const subtree_totals& directory::totals() const {
+   return below;
+}
 
-   return labels;
+dirent_range directory::sorted_entries() const {
+   return dirent_range (dirents.data(), sorted_dirents().data(),
+                        dirents.size());
 }
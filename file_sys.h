@@ -3,10 +3,18 @@
 #ifndef __INODE_H__
 #define __INODE_H__
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <exception>
 #include <iostream>
-#include <memory>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
@@ -16,19 +24,196 @@ using namespace std;
 //    An inode is either a directory or a plain file.
 
 enum class file_type {PLAIN_TYPE, DIRECTORY_TYPE};
+
+// path_status -
+//    Outcome of resolving a pathname.  Misses are reported this way
+//    rather than by throwing, since probing for a missing path is
+//    an ordinary thing for a script to do.
+
+enum class path_status {OK, NOT_FOUND, NOT_A_DIRECTORY, NO_NAME};
+
 class inode;
 class base_file;
 class plain_file;
+struct file_text;
 class directory;
-using inode_ptr = shared_ptr<inode>;
-using base_file_ptr = shared_ptr<base_file>;
-using directory_ptr = shared_ptr<directory>;
+class inode_table;
 ostream& operator<< (ostream&, file_type);
 
+/* inode_ptr -
+      A compact handle to an inode owned by the inode_table.  It is
+      just the inode number, so copying one costs nothing and there
+      is no reference count to maintain.  Inode number 0 is never
+      allocated and serves as the null handle.
+*/
+class inode_ptr {
+   private:
+      int nr {0};
+   public:
+      inode_ptr() = default;
+      inode_ptr (nullptr_t) {}
+      explicit inode_ptr (int inode_nr): nr (inode_nr) {}
+      int get_nr() const { return nr; }
+      inode* operator->() const;
+      inode& operator*() const;
+      explicit operator bool() const { return nr != 0; }
+      bool operator== (inode_ptr that) const { return nr == that.nr; }
+      bool operator!= (inode_ptr that) const { return nr != that.nr; }
+};
+ostream& operator<< (ostream&, inode_ptr);
+
+/* dirent -
+      One entry of a directory.  The type of the inode is kept here
+      too, so a walk can tell directories from files without looking
+      at every child.
+   dirent_view -
+      What iterating over a directory yields:  the name, the inode it
+      refers to, and its type, all straight out of the dirent.
+   dirent_range -
+      The entries of one directory, either in storage order or in
+      lexicographic order, including dot (.) and dotdot (..).  Valid
+      until the directory is next changed.
+*/
+struct dirent {
+   string name;
+   size_t hash;
+   inode_ptr node;
+   file_type type;
+};
+
+struct dirent_view {
+   string_view name;
+   inode_ptr node;
+   file_type type;
+};
+
+class dirent_range {
+   private:
+      const dirent* entries;
+      const int* order;
+      size_t count;
+   public:
+      class iterator {
+         private:
+            const dirent* entries;
+            const int* order;
+            size_t pos;
+         public:
+            iterator (const dirent* entries_, const int* order_,
+                      size_t pos_):
+                      entries (entries_), order (order_), pos (pos_) {}
+            dirent_view operator*() const {
+               const dirent& entry = entries[order ? order[pos] : pos];
+               return {entry.name, entry.node, entry.type};
+            }
+            iterator& operator++() { ++pos; return *this; }
+            bool operator!= (const iterator& that) const {
+               return pos != that.pos;
+            }
+      };
+      dirent_range (const dirent* entries_, const int* order_,
+                    size_t count_):
+                    entries (entries_), order (order_), count (count_) {}
+      iterator begin() const { return {entries, order, 0}; }
+      iterator end() const { return {entries, order, count}; }
+      size_t size() const { return count; }
+};
+
+/* dentry_cache -
+      Remembers which directory a path prefix resolved to, so that
+      commands working under the same few directories skip the walk.
+      Keys are the number of the inode the walk started from followed
+      by the normalized components, so "/a/b", "//a/./b/" and, from
+      the root, "a/b" all share one entry.  Only directories are
+      cached, and never through "..", so an entry depends only on the
+      directories named in its own key.
+   Invalidation -
+      A directory cannot be removed until it is empty, so by the time
+      one is released every entry below it is already gone, and
+      forget need only drop the entries naming the released inode.
+      The inode_table calls it from release.  mkdir, mkfile and
+      setdir only ever add names or rebind . and .., which no cached
+      prefix goes through, so they leave the cache alone.
+   hits, misses -
+      Counters of lookups since startup.
+   Locking -
+      Commands that only read the filesystem still fill the cache, so
+      it has a reader-writer lock of its own:  lookups share it and
+      changes take it exclusively.
+*/
+class dentry_cache {
+   private:
+      static unordered_map<string,inode_ptr> entries;
+      static unordered_multimap<int,const string*> keys_by_inode;
+      static shared_mutex guard;
+      static atomic<size_t> hit_count;
+      static atomic<size_t> miss_count;
+      static void clear_locked();
+   public:
+      static constexpr size_t MAX_ENTRIES {1 << 16};
+      static inode_ptr lookup (const string& key);
+      static void insert (const string& key, inode_ptr dir);
+      static void forget (inode_ptr node);
+      static void clear();
+      static size_t size();
+      static size_t hits();
+      static size_t misses();
+};
+
+/* subtree_totals -
+      What a subtree holds:  the number of plain files, the number of
+      directories and the total size of the plain files in bytes.
+      Every directory keeps the totals of everything below it,
+      adjusted on the way up to the root whenever a file or directory
+      is made, written, removed or detached, so asking for them never
+      walks the subtree.  They are signed so they can also serve as
+      the adjustment.
+*/
+struct subtree_totals {
+   int64_t files {0};
+   int64_t dirs {0};
+   int64_t bytes {0};
+   subtree_totals& operator+= (const subtree_totals& that) {
+      files += that.files;
+      dirs += that.dirs;
+      bytes += that.bytes;
+      return *this;
+   }
+   subtree_totals operator-() const { return {-files, -dirs, -bytes}; }
+};
+
 /* inode_state -
       A small convenient class to maintain the state of the simulated
-      process:  the root (/), the current directory (.), and the
-      prompt.
+      process:  the root (/), the current directory (.), the prompt
+      and the stream commands print to, which is cout unless set.
+      A server has one per session, all sharing one root, and every
+      one is registered so that a change made through one of them
+      can fix up the others.
+   inode_state (root) -
+      A new session on an existing root, starting at the root.  The
+      caller must hold the filesystem lock, at least shared.
+   reset -
+      Switches every state sharing this root to a new root, such as
+      one loaded from an image, and makes it the current directory.
+   current_path -
+      The absolute path of the current directory, which is the path
+      interned in the directory itself, so it costs nothing once
+      built.
+   leave_subtree -
+      Moves the current directory of every state sharing this root
+      to refuge if it is top or anything below it, which must be done
+      before top is released or reused.
+   resolve -
+      Walks a pathname, absolute or relative to the current
+      directory, in a single pass over the characters of the path.
+      Runs of slashes are a single separator, "." stays put and ".."
+      follows the parent entry.  On success sets node and returns OK.
+   resolve_parent -
+      Resolves everything but the last component, which must name
+      something other than the root.  On success sets dir to the
+      containing directory and leaf to a view of the last component.
+   Both look up the directory part of the path in the dentry_cache
+   before walking it, using path_key as a reusable key buffer.
 */
 class inode_state {
    friend class inode;
@@ -36,21 +221,156 @@ class inode_state {
    private:
       inode_state (const inode_state&) = delete; // copy ctor
       inode_state& operator= (const inode_state&) = delete; // op=
+      static mutex sharing_lock;
+      static vector<inode_state*> sharing;
       inode_ptr root {nullptr};
       inode_ptr cwd {nullptr};
       string prompt_ {"% "};
+      ostream* out {&cout};
+      string path_key;
+      void share();
+      path_status walk (inode_ptr base, string_view path,
+                        inode_ptr& node);
+      path_status resolve_dir (inode_ptr base, string_view path,
+                               inode_ptr& dir);
    public:
       inode_state();
+      explicit inode_state (inode_ptr shared_root);
+      ~inode_state();
       const string& prompt();
+      ostream& output();
+      void set_output (ostream&);
       inode_ptr current_dir();
       inode_ptr get_root();
       void set_prompt(string);
       void set_directory(inode_ptr);
+      void reset (inode_ptr new_root);
+      const string& current_path();
+      void leave_subtree (inode_ptr top, inode_ptr refuge);
+      path_status resolve (string_view path, inode_ptr& node);
+      path_status resolve_parent (string_view path, inode_ptr& dir,
+                                  string_view& leaf);
+};
+
+/* inode_table -
+      A static class owning the storage of every inode, plain_file
+      and directory in the simulated filesystem.  Each kind lives in
+      its own slab, indexed by number, and released slots are kept
+      on a free list for reuse.  Slabs are deques so that growing
+      them never moves an existing inode.
+   alloc -
+      Takes a slot (reusing a free one if possible) and initializes
+      it as an empty file or directory with the given name.
+   release -
+      Returns an inode and its contents to the free lists.  Does not
+      look at the children of a directory.
+   get -
+      Maps an inode number to its inode.  Used by inode_ptr.
+   release_tree -
+      Releases an inode and everything below it.  The subtree must
+      already be detached from its parent.  The contents are emptied
+      in parallel, since that is where the memory is given back.
+   clone_tree -
+      The reverse:  makes a copy of an inode and everything below it,
+      detached, for inode::attach to hang somewhere.  Plain files
+      share their text with the originals until either is written.
+      Each directory gets a copy of the other's dirents and hash index
+      as they stand, with only the inode numbers replaced, so no name
+      is hashed or inserted again and the totals come along as they
+      are.  The cost is an inode per node and nothing per byte.
+   clear -
+      Frees every slot at once and empties the dentry_cache and the
+      checkpoints.  Any inode_ptr still held becomes dangling.
+   save -
+      Writes the table to a binary image file, rooted at the given
+      directory.  Only what can be reached from the root is written;
+      other slots, such as those of checkpoints, load as free.  The
+      image is written to a temporary name and renamed into place,
+      so a crash never leaves a partial image.
+   load -
+      Replaces the whole table with the contents of an image file
+      and returns its root.  Inode numbers, including the gaps left
+      by free slots, are the same as when it was saved.  Throws a
+      file_error, leaving the table untouched, if the file is not a
+      valid image.  Parents and subtree_totals are not in the image;
+      they are rebuilt by a walk from the root once it is loaded.
+
+   The image is a header, then one fixed size record per slot, then
+   a heap holding names, file text and arrays of dirents, all in
+   host byte order.  It is mapped in with mmap and read in one pass
+   over the records, which checks every heap reference, copies each
+   file's text and re-inserts each dirent into a new directory.
+   There is no text to parse, but the load still costs a copy of
+   everything and a walk of the whole tree.
+*/
+class inode_table {
+   private:
+      static deque<inode> inodes;
+      static deque<plain_file> files;
+      static deque<directory> dirs;
+      static vector<int> free_inodes;
+      static vector<plain_file*> free_files;
+      static vector<directory*> free_dirs;
+      static void load_mapped (const char* image, size_t image_size,
+                               deque<inode>& new_inodes,
+                               deque<plain_file>& new_files,
+                               deque<directory>& new_dirs,
+                               vector<int>& new_free_inodes, int& root);
+      static void rebuild_totals (inode_ptr root);
+   public:
+      static inode_ptr alloc (file_type, const string& name);
+      static void release (inode_ptr);
+      static void release_tree (inode_ptr);
+      static inode_ptr clone_tree (inode_ptr);
+      static inode& get (int inode_nr);
+      static size_t size();
+      static void clear();
+      static void save (const string& filename, inode_ptr root);
+      static inode_ptr load (const string& filename);
+};
+
+/* checkpoints -
+      A static class keeping versions of the filesystem, each a
+      detached copy of the whole tree made by clone_tree and numbered
+      from 1.  A version shares the text of every file with the live
+      tree until one side writes it, so it costs an inode per node
+      and nothing per byte, to take or to restore.
+   take -
+      Copies the tree under root and returns the new version number.
+   restore -
+      Releases everything below root and puts a fresh copy of the
+      contents of a version in its place.  The root keeps its inode
+      number, but nothing below it does.  The version itself is
+      kept, so it can be restored again.  Throws a file_error if
+      there is no such version.  No session may be below the root.
+   release -
+      Releases a version and everything in it back to the inode_table.
+      Returns false if there is no such version.
+   release_all, forget_all -
+      Release every version, or just forget them when the inode_table
+      is cleared out from under them.  Forgetting also numbers the
+      versions from 1 again, as after a load, so that a journal
+      replayed from that point numbers them the same way.
+   versions -
+      Every version, by number, with the root of its copy.
+*/
+class checkpoints {
+   private:
+      static map<int,inode_ptr> saved;
+      static int last_id;
+   public:
+      static int take (inode_ptr root);
+      static void restore (int id, inode_ptr root);
+      static bool release (int id);
+      static void release_all();
+      static void forget_all();
+      static const map<int,inode_ptr>& versions();
 };
 
 /* class inode -
    inode ctor -
-      Create a new inode of the given type.
+      Create a new inode of the given type.  Only called by the
+      inode_table, which supplies the number and the contents.
    get_inode_nr -
       Retrieves the serial number of the inode.  Inode numbers are
       allocated in sequence by small integer.
@@ -59,36 +379,75 @@ class inode_state {
    get_contents -
       Returns the contents of the inode, whether it is a directory
       or a file.
+   children, sorted_children -
+      Iterate over the dirents of a directory, in storage order or
+      lexicographic order.  Throws a file_error for a plain file.
    size -
       Returns the size of an inode.  For a directory, this is the
       number of dirents.  For a text file, the number of characters
       when printed (the sum of the lengths of each word, plus the
-      number of words.
+      spaces between them).
+   totals -
+      The subtree_totals of the inode itself and everything below it.
+   get_path -
+      The absolute path of a directory.  Each directory interns its
+      path the first time it is asked for, built from its parent's,
+      so later calls are O(1).  Since there are no hard links and no
+      renames, a path only goes stale when its directory is released,
+      which clears it.  Readers may intern paths concurrently, so
+      building them is serialized by a lock of its own.
+   print -
+      Prints a plain file as cat does, or a directory as ls does.
+      With subtree_sizes, the size column of a directory listing
+      gives the bytes in each entry's subtree instead.
+   attach -
+      The reverse of detach:  adds a detached subtree, such as one
+      from clone_tree, under the given name, which must be new and
+      becomes the name of its top.
+   readfile -
+      A view of the text of a plain file, valid until it is written.
+      Throws a file_error for a directory.
+   make_dir, make_file, writefile, remove, detach, attach -
+      Besides changing the directory or file, keep the parent and
+      the subtree_totals of every directory above up to date.
 */
 class inode {
    friend class inode_state;
+   friend class inode_table;
    friend ostream& operator<< (ostream& out, inode&);
    private:
-      static int next_inode_nr;
       int inode_nr;
-      base_file_ptr contents;
       file_type type;
+      base_file* contents;
       string name;
+      inode_ptr parent;
+      directory& dir();
+      plain_file& file();
+      void add_totals (const subtree_totals& delta);
    public:
-      inode (file_type, string);
+      inode (int, file_type, const string&, base_file*);
       int get_inode_nr() const;
       file_type get_file_type();
       inode_ptr get_child_directory(string name);
-      wordvec get_child_names();
+      inode_ptr lookup (string_view name);
+      dirent_range children();
+      dirent_range sorted_children();
       int size();
+      subtree_totals totals();
+      const string& get_path();
+      void print (ostream& out, bool subtree_sizes);
       string get_name();
       void set_root(inode_ptr);
       void set_parent(inode_ptr);
       inode_ptr get_parent();
-      void writefile(const wordvec&);
+      string_view readfile();
+      void writefile(string&&);
+      void writefile (file_text&&);
       inode_ptr make_dir(string);
       inode_ptr make_file(string);
       void remove(string);
+      inode_ptr detach (const string& name);
+      void attach (const string& name, inode_ptr subtree);
 };
 
 /* class base_file -
@@ -112,31 +471,58 @@ class base_file {
    public:
       virtual ~base_file() = default;
       virtual size_t size() const = 0;
-      virtual const wordvec& readfile() const = 0;
-      virtual void writefile (const wordvec& newdata) = 0;
+      virtual string_view readfile() const = 0;
+      virtual void writefile (string&& newdata) = 0;
       virtual void remove (const string& filename) = 0;
       virtual inode_ptr mkdir (const string& dirname) = 0;
       virtual inode_ptr mkfile (const string& filename) = 0;
 };
 
+/* file_text -
+   The text of a plain file:  the words in one buffer, separated by
+   single spaces exactly as cat prints them.
+*/
+struct file_text {
+   string data;
+};
+
 /* class plain_file -
-   Used to hold data.
+   Used to hold data, as a file_text that copies of the file share.
+   An empty file has none at all.
    synthesized default ctor -
-      Default vector<string> is a an empty vector.
+      Default buffer is empty, with no words.
+   size -
+      The length of the buffer, which is kept by the string itself.
    readfile -
-      Returns a copy of the contents of the wordvec in the file.
+      Returns a view of the buffer, valid until the next write.
    writefile -
-      Replaces the contents of a file with new contents.
+      Replaces the contents of a file with new contents, taking over
+      the caller's buffer.  The words in it must be separated by
+      single spaces.  A text that other files still share is left to
+      them, and only this file gets the new one; otherwise the old
+      buffers are reused.  Given a file_text, such as one made by
+      import, it is taken over as it is.
+   share -
+      Makes this file a copy of that one in O(1), sharing its text
+      until either of them is written.
 */
 class plain_file: public base_file {
+   friend class inode_table;
    friend ostream& operator<< (ostream& out, const plain_file&);
    private:
-      wordvec data;
+      static const file_text EMPTY_TEXT;
+      shared_ptr<file_text> text;
+      const file_text& current() const {
+         return text ? *text : EMPTY_TEXT;
+      }
    public:
       plain_file();
+      void clear();
+      void share (const plain_file& that);
       virtual size_t size() const override;
-      virtual const wordvec& readfile() const override;
-      virtual void writefile (const wordvec& newdata) override;
+      virtual string_view readfile() const override;
+      virtual void writefile (string&& newdata) override;
+      void writefile (file_text&& newtext);
       virtual void remove (const string& filename) override;
       virtual inode_ptr mkdir (const string& dirname) override;
       virtual inode_ptr mkfile (const string& filename) override;
@@ -159,25 +545,83 @@ class plain_file: public base_file {
    mkfile -
       Create a new empty text file with the given name.  Error if
       a dirent with that name exists.
+   lookup -
+      Finds a dirent without copying the name, returning nullptr
+      if there is no such entry.
+   detach -
+      Removes an entry, empty or not, without releasing it, and
+      returns what it referred to.  Throws a file_error if there is
+      no such entry.
+   entries, sorted_entries -
+      The dirents, in storage order or lexicographic order.
+   totals -
+      The subtree_totals of everything below this directory, which
+      the inode keeps up to date.
+   print -
+      Prints the listing ls shows, optionally with subtree sizes.
+
+   The dirents are kept unordered in a dense vector.  Up to
+   SMALL_DIR of them are simply scanned; beyond that an open
+   addressing index (linear probing, backward shift deletion) maps
+   names to positions in the vector.  Lexicographic order is only
+   needed for printing, so it is computed on demand and cached until
+   the next insert or erase.  Both it and the interned path are
+   published with a flag, so concurrent readers find them built
+   without taking a lock.
 */
 class directory: public base_file {
+   friend class inode;
+   friend class inode_table;
    friend ostream& operator<< (ostream& out, const directory&);
    private:
-      // Must be a map, not unordered_map, so printing is lexicographic
-      map<string,inode_ptr> dirents;
+      static constexpr size_t SMALL_DIR {8};
+      static constexpr int EMPTY {-1};
+      vector<dirent> dirents;
+      vector<int> index;
+      mutable vector<int> sorted;
+      mutable atomic<bool> sorted_valid {false};
+      subtree_totals below;
+      string path;
+      atomic<bool> path_valid {false};
+      int find (string_view name, size_t hash) const;
+      size_t find_bucket (int entry) const;
+      void insert (const string& name, inode_ptr node, file_type);
+      void erase (int entry);
+      void rehash (size_t buckets);
+      const vector<int>& sorted_dirents() const;
    public:
       directory();
       directory(inode_ptr, inode_ptr);
+      void clear();
       virtual size_t size() const override;
-      virtual const wordvec& readfile() const override;
-      virtual void writefile (const wordvec& newdata) override;
+      virtual string_view readfile() const override;
+      virtual void writefile (string&& newdata) override;
+      void writefile (file_text&& newtext);
       virtual void remove (const string& filename) override;
       virtual inode_ptr mkdir (const string& dirname) override;
       virtual inode_ptr mkfile (const string& filename) override;
-      void setdir(string, inode_ptr);
+      void setdir(string, inode_ptr,
+                  file_type = file_type::DIRECTORY_TYPE);
       inode_ptr get_dirent(string name);
-      wordvec get_content_labels();
+      inode_ptr lookup (string_view name) const;
+      inode_ptr detach (const string& name);
+      dirent_range entries() const;
+      dirent_range sorted_entries() const;
+      const subtree_totals& totals() const;
+      void print (ostream& out, bool subtree_sizes) const;
 };
 
+inline inode& inode_table::get (int inode_nr) {
+   return inodes[inode_nr];
+}
+
+inline inode* inode_ptr::operator->() const {
+   return &inode_table::get (nr);
+}
+
+inline inode& inode_ptr::operator*() const {
+   return inode_table::get (nr);
+}
+
 #endif
 
@@ -0,0 +1,255 @@
+// $Id: hostfs.cpp,v 1.1 2026-10-16 20:31:48-07 - - $
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "debug.h"
+#include "hostfs.h"
+#include "util.h"
+
+// A file's words may be split across lines as well as by blanks.
+static const delimiter_set FILE_WHITESPACE {" \t\n\r\v\f"};
+
+// Directories and files are handed to parallel_for this many at a
+// time.  Most files are small enough that one alone is too little.
+static constexpr size_t DIRECTORY_GRAIN {1};
+static constexpr size_t FILE_GRAIN {16};
+
+static file_error host_error (const string& path) {
+   return file_error (path + ": " + strerror (errno));
+}
+
+/*** IMPORT ***/
+// host_node -
+//    A file or directory read from the host, held until the whole
+//    tree has been read and can be added to the inode_table.
+
+struct host_node {
+   string name;
+   bool is_directory;
+   file_text text;
+   vector<host_node> children;
+};
+
+struct import_item {
+   string path;
+   host_node* node;
+};
+
+// Reads the names in a host directory, sorted so that the inode
+// numbers they get do not depend on the host's order.  The types
+// come from the directory entries themselves where the host keeps
+// them there, so only odd filesystems need a stat per entry.
+static void read_directory (const string& path, host_node& node) {
+   error_code error;
+   filesystem::directory_iterator entries (path, error);
+   for (; not error and entries != filesystem::directory_iterator();
+        entries.increment (error)) {
+      filesystem::file_type type = entries->symlink_status (error).type();
+      if (error) break;
+      if (type != filesystem::file_type::directory
+          and type != filesystem::file_type::regular) continue;
+      node.children.push_back ({entries->path().filename(),
+                                type == filesystem::file_type::directory,
+                                {}, {}});
+   }
+   if (error) throw file_error (path + ": " + error.message());
+   sort (node.children.begin(), node.children.end(),
+         [] (const host_node& one, const host_node& two) {
+            return one.name < two.name;
+         });
+}
+
+// Maps a host file in and splits it into words.
+static void read_text (const string& path, file_text& text) {
+   int fd = open (path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd < 0) throw host_error (path);
+   struct stat info;
+   if (fstat (fd, &info) != 0) {
+      int error = errno;
+      close (fd);
+      errno = error;
+      throw host_error (path);
+   }
+   size_t size = info.st_size;
+   if (size == 0) {
+      close (fd);
+      return;
+   }
+   void* mapped = mmap (nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   int error = errno;
+   close (fd);
+   if (mapped == MAP_FAILED) {
+      errno = error;
+      throw host_error (path);
+   }
+   madvise (mapped, size, MADV_SEQUENTIAL);
+   string_view view (static_cast<const char*> (mapped), size);
+   string& data = text.data;
+   data.reserve (size);
+   for (size_t start = skip_delimiters (view, 0, FILE_WHITESPACE);
+        start != string_view::npos;
+        start = skip_delimiters (view, start, FILE_WHITESPACE)) {
+      size_t end = find_delimiter (view, start, FILE_WHITESPACE);
+      if (end == string_view::npos) end = size;
+      if (not data.empty()) data += ' ';
+      data.append (view.data() + start, end - start);
+      start = end;
+   }
+   munmap (mapped, size);
+   data.shrink_to_fit();
+}
+
+// Adds the tree that was read to the inode_table, all in one go on
+// this thread, since the table is not safe to grow from several.
+static inode_ptr build_tree (host_node& top) {
+   file_type type = top.is_directory ? file_type::DIRECTORY_TYPE
+                                     : file_type::PLAIN_TYPE;
+   inode_ptr made = inode_table::alloc (type, top.name);
+   if (not top.is_directory) {
+      made->writefile (move (top.text));
+      return made;
+   }
+   made->set_root (made);
+   made->set_parent (made);
+   vector<pair<host_node*,inode_ptr>> pending {{&top, made}};
+   while (not pending.empty()) {
+      auto [node, dir] = pending.back();
+      pending.pop_back();
+      for (host_node& child: node->children) {
+         if (child.is_directory) {
+            pending.emplace_back (&child, dir->make_dir (child.name));
+         }else {
+            dir->make_file (child.name)->writefile (move (child.text));
+         }
+      }
+   }
+   return made;
+}
+
+inode_ptr import_tree (const string& host_path, const string& name) {
+   struct stat info;
+   if (stat (host_path.c_str(), &info) != 0) throw host_error (host_path);
+   if (not S_ISDIR (info.st_mode) and not S_ISREG (info.st_mode)) {
+      throw file_error (host_path + ": not a file or directory");
+   }
+   host_node top {name, S_ISDIR (info.st_mode) != 0, {}, {}};
+   if (not top.is_directory) {
+      read_text (host_path, top.text);
+      return build_tree (top);
+   }
+
+   // A level of directories is read at a time, then the files in
+   // them, while their subdirectories make up the next level.
+   vector<import_item> level {{host_path, &top}};
+   vector<import_item> next;
+   vector<import_item> files;
+   size_t directories = 0;
+   size_t file_count = 0;
+   while (not level.empty()) {
+      parallel_for (level.size(), [&level] (size_t index) {
+         read_directory (level[index].path, *level[index].node);
+      }, DIRECTORY_GRAIN);
+      next.clear();
+      files.clear();
+      for (import_item& item: level) {
+         for (host_node& child: item.node->children) {
+            (child.is_directory ? next : files).push_back (
+                  {item.path + "/" + child.name, &child});
+         }
+      }
+      parallel_for (files.size(), [&files] (size_t index) {
+         read_text (files[index].path, files[index].node->text);
+      }, FILE_GRAIN);
+      directories += level.size();
+      file_count += files.size();
+      level.swap (next);
+   }
+   DEBUGF ('h', host_path << ": " << directories << " directories, "
+           << file_count << " files");
+   return build_tree (top);
+}
+
+/*** EXPORT ***/
+struct export_item {
+   inode_ptr node;
+   string path;
+};
+
+static bool write_fully (int fd, const char* data, size_t left) {
+   while (left > 0) {
+      ssize_t written = write (fd, data, left);
+      if (written < 0) {
+         if (errno == EINTR) continue;
+         return false;
+      }
+      data += written;
+      left -= written;
+   }
+   return true;
+}
+
+static void make_directory (const string& path) {
+   if (mkdir (path.c_str(), 0777) == 0) return;
+   struct stat info;
+   if (errno == EEXIST and stat (path.c_str(), &info) == 0
+       and S_ISDIR (info.st_mode)) return;
+   throw host_error (path);
+}
+
+static void write_text (inode_ptr file, const string& path) {
+   int fd = open (path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+   if (fd < 0) throw host_error (path);
+   string_view text = file->readfile();
+   bool written = write_fully (fd, text.data(), text.size())
+              and write_fully (fd, "\n", 1);
+   int error = errno;
+   if (close (fd) != 0 and written) {
+      error = errno;
+      written = false;
+   }
+   if (not written) {
+      errno = error;
+      throw host_error (path);
+   }
+}
+
+void export_tree (inode_ptr top, const string& host_path) {
+   if (top->get_file_type() == file_type::PLAIN_TYPE) {
+      write_text (top, host_path);
+      return;
+   }
+   vector<export_item> level {{top, host_path}};
+   vector<export_item> next;
+   vector<export_item> files;
+   while (not level.empty()) {
+      parallel_for (level.size(), [&level] (size_t index) {
+         make_directory (level[index].path);
+      }, DIRECTORY_GRAIN);
+      next.clear();
+      files.clear();
+      for (export_item& item: level) {
+         for (dirent_view child: item.node->children()) {
+            if (child.name == "." or child.name == "..") continue;
+            (child.type == file_type::DIRECTORY_TYPE ? next : files)
+                  .push_back ({child.node,
+                               item.path + "/" + string (child.name)});
+         }
+      }
+      parallel_for (files.size(), [&files] (size_t index) {
+         write_text (files[index].node, files[index].path);
+      }, FILE_GRAIN);
+      level.swap (next);
+   }
+}
+
@@ -0,0 +1,38 @@
+// $Id: hostfs.h,v 1.1 2026-10-16 20:31:48-07 - - $
+
+// hostfs -
+//    Copies whole trees between the host's filesystem and the
+//    simulated one, so a production tree can be modelled without
+//    typing it in.  Both directions are spread over the hardware
+//    threads, one directory or file at a time.  Only directories and
+//    regular files are copied; symbolic links and anything else are
+//    skipped, so a walk never leaves the tree or goes round a cycle.
+
+#ifndef __HOSTFS_H__
+#define __HOSTFS_H__
+
+#include <string>
+using namespace std;
+
+#include "file_sys.h"
+
+// import_tree -
+//    Reads a host file or directory tree into a detached subtree
+//    with the given name at its top, for inode::attach to hang
+//    somewhere.  The host tree is read in parallel, each file mapped
+//    in with mmap and split into words at any whitespace, which are
+//    then kept separated by single spaces, as make would keep them.
+//    Nothing is added to the table until all of it has been read,
+//    so a file_error, thrown for the first thing that could not be
+//    read, leaves the table as it was.
+// export_tree -
+//    Writes a subtree out to the host path, making directories as
+//    needed and replacing files.  Each file is written as cat would
+//    print it.  Throws a file_error for the first thing that could
+//    not be written, though by then others may have been.
+
+inode_ptr import_tree (const string& host_path, const string& name);
+void export_tree (inode_ptr top, const string& host_path);
+
+#endif
+
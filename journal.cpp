@@ -0,0 +1,345 @@
+// $Id: journal.cpp,v 1.1 2026-10-16 19:05:12-07 - - $
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "commands.h"
+#include "debug.h"
+#include "journal.h"
+
+// The header is the magic and the generation of the snapshot.  Each
+// record is its length and checksum, then the current directory, a
+// newline, and the words of the command separated by spaces.  The
+// directory of a command that failed has a '!' in front.
+static constexpr char JOURNAL_MAGIC[8] {'Y','S','H','J','R','N','0','1'};
+static constexpr size_t HEADER_SIZE {sizeof JOURNAL_MAGIC
+                                     + sizeof (uint64_t)};
+static constexpr size_t RECORD_HEAD {2 * sizeof (uint32_t)};
+
+string journal::filename;
+int journal::fd {-1};
+uint64_t journal::generation {0};
+inode_state* journal::main_state {nullptr};
+mutex journal::lock;
+condition_variable journal::work;
+condition_variable journal::synced;
+string journal::pending;
+uint64_t journal::appended {0};
+uint64_t journal::durable {0};
+uint64_t journal::file_bytes {0};
+bool journal::stopping {false};
+bool journal::failed {false};
+thread journal::committer;
+
+// FNV-1a, which is enough to tell a torn record from a whole one.
+static uint32_t checksum (const char* data, size_t size) {
+   uint32_t hash = 2166136261u;
+   for (size_t index = 0; index < size; ++index) {
+      hash = (hash ^ static_cast<unsigned char> (data[index]))
+           * 16777619u;
+   }
+   return hash;
+}
+
+static void put_header (string& out, uint64_t generation) {
+   out.append (JOURNAL_MAGIC, sizeof JOURNAL_MAGIC);
+   out.append (reinterpret_cast<const char*> (&generation),
+               sizeof generation);
+}
+
+static string snapshot_name (const string& filename,
+                             uint64_t generation) {
+   return filename + "." + to_string (generation) + ".img";
+}
+
+static bool write_fully (int fd, const char* data, size_t left) {
+   while (left > 0) {
+      ssize_t written = write (fd, data, left);
+      if (written < 0) {
+         if (errno == EINTR) continue;
+         return false;
+      }
+      data += written;
+      left -= written;
+   }
+   return true;
+}
+
+static bool read_fully (int fd, string& text) {
+   char block[1 << 16];
+   for (;;) {
+      ssize_t got = read (fd, block, sizeof block);
+      if (got < 0 and errno == EINTR) continue;
+      if (got < 0) return false;
+      if (got == 0) return true;
+      text.append (block, got);
+   }
+}
+
+// Syncs a file that was written through some other descriptor, or a
+// directory so that a rename in it is on disk.
+static bool sync_path (const string& path) {
+   int sync_fd = ::open (path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (sync_fd < 0) return false;
+   bool synced = fsync (sync_fd) == 0;
+   ::close (sync_fd);
+   return synced;
+}
+
+static string directory_of (const string& path) {
+   size_t slash = path.rfind ('/');
+   if (slash == string::npos) return ".";
+   if (slash == 0) return "/";
+   return path.substr (0, slash);
+}
+
+void journal::write_record (string& out, const string& cwd,
+                            const wordspan& words, bool failed) {
+   size_t head = out.size();
+   out.append (RECORD_HEAD, '\0');
+   if (failed) out += '!';
+   out += cwd;
+   out += '\n';
+   for (size_t index = 0; index < words.size(); ++index) {
+      if (index > 0) out += ' ';
+      out.append (words.at (index).data(), words.at (index).size());
+   }
+   uint32_t length = out.size() - head - RECORD_HEAD;
+   uint32_t sum = checksum (out.data() + head + RECORD_HEAD, length);
+   memcpy (&out[head], &length, sizeof length);
+   memcpy (&out[head + sizeof length], &sum, sizeof sum);
+}
+
+// Runs every whole record in the text, with the output thrown away,
+// and returns the offset just past the last one.
+size_t journal::replay (inode_state& state, const string& text) {
+   ostream& saved_output = state.output();
+   ostream discard (nullptr);
+   state.set_output (discard);
+   tokenizer line_tokenizer;
+   size_t offset = HEADER_SIZE;
+   size_t records = 0;
+   while (text.size() - offset >= RECORD_HEAD) {
+      uint32_t length;
+      uint32_t sum;
+      memcpy (&length, &text[offset], sizeof length);
+      memcpy (&sum, &text[offset + sizeof length], sizeof sum);
+      if (length > text.size() - offset - RECORD_HEAD) break;
+      string_view record (&text[offset + RECORD_HEAD], length);
+      size_t newline = record.find ('\n');
+      if (checksum (record.data(), length) != sum
+          or newline == string_view::npos) break;
+      offset += RECORD_HEAD + length;
+      ++records;
+      string_view cwd = record.substr (0, newline);
+      bool failed = not cwd.empty() and cwd.front() == '!';
+      if (failed) cwd.remove_prefix (1);
+      wordspan words = line_tokenizer.split (record.substr (newline + 1));
+      DEBUGF ('j', "replay " << cwd << ": " << words);
+      if (words.empty()) continue;
+      try {
+         inode_ptr dir;
+         if (state.resolve (cwd, dir) != path_status::OK
+             or dir->get_file_type() != file_type::DIRECTORY_TYPE) {
+            throw command_error (string (cwd) + ": no such directory");
+         }
+         state.set_directory (dir);
+         run_command (state, words);
+      }catch (command_error& error) {
+         if (not failed) {
+            complain() << filename << ": replay: " << error.what()
+                       << endl;
+         }
+      }catch (file_error& error) {
+         if (not failed) {
+            complain() << filename << ": replay: " << error.what()
+                       << endl;
+         }
+      }
+   }
+   state.set_output (saved_output);
+   DEBUGF ('j', filename << ": replayed " << records << " records");
+   return offset;
+}
+
+void journal::open (inode_state& state, const string& name) {
+   filename = name;
+   main_state = &state;
+   string text;
+   int in = ::open (filename.c_str(), O_RDONLY | O_CLOEXEC);
+   if (in >= 0) {
+      bool read_ok = read_fully (in, text);
+      int error = errno;
+      ::close (in);
+      if (not read_ok) {
+         throw file_error (filename + ": " + strerror (error));
+      }
+   }else if (errno != ENOENT) {
+      throw file_error (filename + ": " + strerror (errno));
+   }
+
+   size_t good = 0;
+   if (not text.empty()) {
+      if (text.size() < HEADER_SIZE
+          or memcmp (text.data(), JOURNAL_MAGIC, sizeof JOURNAL_MAGIC)) {
+         throw file_error (filename + ": not a journal of this version");
+      }
+      memcpy (&generation, &text[sizeof JOURNAL_MAGIC],
+              sizeof generation);
+      if (generation > 0) {
+         state.reset (inode_table::load (snapshot_name (filename,
+                                                        generation)));
+      }
+      good = replay (state, text);
+   }
+
+   fd = ::open (filename.c_str(),
+                O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+   if (fd < 0) throw file_error (filename + ": " + strerror (errno));
+   bool ready = true;
+   if (text.empty()) {
+      string header;
+      put_header (header, generation);
+      ready = write_fully (fd, header.data(), header.size())
+          and fdatasync (fd) == 0;
+      good = header.size();
+   }else if (good < text.size()) {
+      complain() << filename << ": cut off a torn record at byte "
+                 << good << endl;
+      ready = ftruncate (fd, good) == 0;
+   }
+   if (not ready) {
+      int error = errno;
+      ::close (fd);
+      fd = -1;
+      throw file_error (filename + ": " + strerror (error));
+   }
+   file_bytes = good;
+   stopping = false;
+   committer = thread (commit);
+}
+
+void journal::append (inode_state& state, const string& cwd,
+                      const wordspan& words, bool session_only,
+                      bool failed) {
+   if (fd < 0 or (session_only and &state != main_state)) return;
+   lock_guard<mutex> guard (lock);
+   size_t before = pending.size();
+   write_record (pending, cwd, words, failed);
+   file_bytes += pending.size() - before;
+   ++appended;
+   work.notify_one();
+}
+
+// The committer.  It swaps out everything pending and writes it with
+// one write and one fdatasync, while commands go on appending to the
+// next batch.  It blocks every signal, so that one meant for the
+// server is left to the threads that wait for it.
+void journal::commit() {
+   sigset_t all_signals;
+   sigfillset (&all_signals);
+   pthread_sigmask (SIG_BLOCK, &all_signals, nullptr);
+   string batch;
+   unique_lock<mutex> guard (lock);
+   for (;;) {
+      work.wait (guard, [] { return stopping or not pending.empty(); });
+      if (pending.empty()) break;
+      batch.clear();
+      batch.swap (pending);
+      uint64_t upto = appended;
+      guard.unlock();
+      bool written = write_fully (fd, batch.data(), batch.size())
+                 and fdatasync (fd) == 0;
+      int error = errno;
+      guard.lock();
+      if (not written and not failed) {
+         failed = true;
+         complain() << filename << ": " << strerror (error) << endl;
+      }
+      DEBUGF ('j', "synced " << batch.size() << " bytes, "
+              << upto - durable << " records");
+      durable = upto;
+      synced.notify_all();
+   }
+}
+
+void journal::compact_if_due() {
+   if (fd < 0 or file_bytes < COMPACT_BYTES
+       or not checkpoints::versions().empty()) return;
+   wait_durable();
+   uint64_t next = generation + 1;
+   string image = snapshot_name (filename, next);
+   string tempname = filename + ".tmp";
+
+   // The new journal starts with the main session's place and prompt,
+   // which are all the old records say that the snapshot does not.
+   string fresh;
+   put_header (fresh, next);
+   vector<string_view> words {"cd", main_state->current_path()};
+   write_record (fresh, "/", words, false);
+   tokenizer prompt_tokenizer;
+   words = {"prompt"};
+   for (string_view word: prompt_tokenizer.split (main_state->prompt())) {
+      words.push_back (word);
+   }
+   write_record (fresh, "/", words, false);
+
+   int fresh_fd = -1;
+   try {
+      inode_table::save (image, main_state->get_root());
+      fresh_fd = ::open (tempname.c_str(), O_WRONLY | O_APPEND | O_CREAT
+                         | O_TRUNC | O_CLOEXEC, 0666);
+      if (not sync_path (image) or fresh_fd < 0
+          or not write_fully (fresh_fd, fresh.data(), fresh.size())
+          or fdatasync (fresh_fd) != 0
+          or rename (tempname.c_str(), filename.c_str()) != 0) {
+         throw file_error (filename + ": compaction: "
+                           + strerror (errno));
+      }
+   }catch (file_error& error) {
+      complain() << error.what() << endl;
+      if (fresh_fd >= 0) ::close (fresh_fd);
+      unlink (tempname.c_str());
+      unlink (image.c_str());
+      // Carry on with the old journal rather than retry every command.
+      file_bytes = 0;
+      return;
+   }
+   sync_path (directory_of (filename));
+
+   lock_guard<mutex> guard (lock);
+   ::close (fd);
+   fd = fresh_fd;
+   if (generation > 0) unlink (snapshot_name (filename,
+                                              generation).c_str());
+   DEBUGF ('j', filename << ": compacted " << file_bytes
+           << " bytes into generation " << next);
+   generation = next;
+   file_bytes = fresh.size();
+   checkpoints::forget_all();
+}
+
+void journal::wait_durable() {
+   unique_lock<mutex> guard (lock);
+   uint64_t target = appended;
+   synced.wait (guard, [target] { return durable >= target; });
+}
+
+void journal::close() {
+   if (fd < 0) return;
+   {
+      lock_guard<mutex> guard (lock);
+      stopping = true;
+      work.notify_one();
+   }
+   committer.join();
+   ::close (fd);
+   fd = -1;
+}
+
@@ -0,0 +1,99 @@
+// $Id: journal.h,v 1.1 2026-10-16 19:05:12-07 - - $
+
+// journal -
+//    An optional write-ahead journal, so a long session survives a
+//    crash without running its whole script again.  Every command
+//    that changes the filesystem is appended once it has run, as the
+//    words it was given and the directory it ran in, and so are cd
+//    and prompt in the main session when they succeed.  A writer
+//    that failed is marked as such, since it may have done part of
+//    its work, and replay expects it to fail again and says nothing.
+//    On startup the journal is replayed on top of its last snapshot.
+//    Replay runs commands again rather than redoing their effects,
+//    so a load or an import replays from the image or host tree as
+//    it is now.
+//
+//    Records are written and synced by a committer thread.  Whatever
+//    was appended while it was syncing goes out in the next write
+//    with a single fdatasync, so a script never waits on the disk
+//    and concurrent sessions share their syncs.  Each record carries
+//    its length and a checksum, and a record torn by a crash ends
+//    the replay and is cut off.
+//
+//    Once the journal grows past COMPACT_BYTES it is compacted:  the
+//    tree is saved as a snapshot image and the journal starts over
+//    with just the cd and prompt of the main session.  The journal
+//    names the generation of its snapshot in its header, so a crash
+//    part way through leaves either the old pair or the new one.
+//    Images do not hold checkpoints, so compaction waits until none
+//    are held, and checkpoints are numbered from 1 again after it.
+// open -
+//    Loads the snapshot and replays the journal into state, creating
+//    the journal if there is none, then journals state's commands
+//    from here on.  Throws a file_error if the journal cannot be
+//    read or written.
+// enabled -
+//    Whether there is a journal, so a command need not note the
+//    directory it runs in when nothing will be written.
+// append -
+//    Queues a record of a command that has just run, the directory
+//    cwd it was run in, taken before it ran, and whether it failed.
+//    Does nothing if there is no journal, or for a command that
+//    changes only the session, unless run by the main session.
+// compact_if_due -
+//    Compacts the journal if it is due.  The caller must hold the
+//    filesystem lock exclusively.
+// wait_durable -
+//    Waits until everything appended so far is on disk.  Called
+//    before each prompt, so an interactive command is durable once
+//    the next prompt shows.
+// close -
+//    Syncs what is left and stops the committer.
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+using namespace std;
+
+#include "file_sys.h"
+#include "util.h"
+
+class journal {
+   private:
+      static constexpr size_t COMPACT_BYTES {16 << 20};
+      static string filename;
+      static int fd;
+      static uint64_t generation;
+      static inode_state* main_state;
+      static mutex lock;
+      static condition_variable work;
+      static condition_variable synced;
+      static string pending;
+      static uint64_t appended;
+      static uint64_t durable;
+      static uint64_t file_bytes;
+      static bool stopping;
+      static bool failed;
+      static thread committer;
+      static void commit();
+      static size_t replay (inode_state& state, const string& text);
+      static void write_record (string& out, const string& cwd,
+                                const wordspan& words, bool failed);
+   public:
+      static void open (inode_state& state, const string& filename);
+      static bool enabled() { return fd >= 0; }
+      static void append (inode_state& state, const string& cwd,
+                          const wordspan& words, bool session_only,
+                          bool failed);
+      static void compact_if_due();
+      static void wait_durable();
+      static void close();
+};
+
+#endif
+
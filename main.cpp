@@ -1,30 +1,82 @@
 // $Id: main.cpp,v 1.9 2016-01-14 16:16:52-08 - - $
 
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <utility>
+#include <fcntl.h>
 #include <unistd.h>
 
 using namespace std;
 
+#include "batch.h"
 #include "commands.h"
 #include "debug.h"
 #include "file_sys.h"
+#include "journal.h"
+#include "output.h"
+#include "server.h"
+#include "stats.h"
 #include "util.h"
 
+// yshell_options -
+//    Settings gathered from the command line.
+//    batch_file - script to run in batch mode, empty if none.
+//    image_file - filesystem image to load at startup, empty if none.
+//    journal_file - write-ahead journal to replay and append to.
+//    socket_path - Unix domain socket to serve sessions on, if any.
+//    verify_teardown - release and check every inode before exiting.
+
+struct yshell_options {
+   string batch_file;
+   string image_file;
+   string journal_file;
+   string socket_path;
+   bool verify_teardown {false};
+};
+
 // scan_options
-//    Options analysis:  The only option is -Dflags.
+//    Options analysis:  -@flags sets debug flags, -b file runs the
+//    file as a batch script, -i image starts from a saved image, -j
+//    file dumps the stats as JSON at exit, -s socket serves sessions
+//    on that socket instead of reading commands, -t file saves the
+//    binary trace there at exit for ytrace to decode, -T tears the
+//    filesystem down carefully at exit, for leak checkers, and -w
+//    file keeps a write-ahead journal there, replaying it first.
 
-void scan_options (int argc, char** argv) {
+yshell_options scan_options (int argc, char** argv) {
+   yshell_options options;
    opterr = 0;
    for (;;) {
-      int option = getopt (argc, argv, "@:");
+      int option = getopt (argc, argv, "@:b:i:j:s:t:Tw:");
       if (option == EOF) break;
       switch (option) {
          case '@':
             debugflags::setflags (optarg);
             break;
+         case 'b':
+            options.batch_file = optarg;
+            break;
+         case 'i':
+            options.image_file = optarg;
+            break;
+         case 'j':
+            stats::set_json_file (optarg);
+            break;
+         case 's':
+            options.socket_path = optarg;
+            break;
+         case 't':
+            trace_ring::set_file (optarg);
+            break;
+         case 'T':
+            options.verify_teardown = true;
+            break;
+         case 'w':
+            options.journal_file = optarg;
+            break;
          default:
             complain() << "-" << static_cast<char> (option)
                        << ": invalid option" << endl;
@@ -34,25 +86,89 @@ void scan_options (int argc, char** argv) {
    if (optind < argc) {
       complain() << "operands not permitted" << endl;
    }
+   return options;
+}
+
+// finish -
+//    Prints the exit status and ends the process.  Normally the whole
+//    filesystem is simply abandoned:  quick_exit skips the static
+//    destructors, so not even the inode_table's slabs are freed, and
+//    the kernel takes the memory back at once however large the tree.
+//    With -T, every inode is released and checked first, and the
+//    process exits normally.  The journal is synced before either.
+
+int finish (inode_state& state, const yshell_options& options) {
+   journal::close();
+   if (options.verify_teardown) verified_teardown (state);
+   trace_ring::finish();
+   int status = exit_status_message();
+   if (options.verify_teardown) return status;
+   cout.flush();
+   quick_exit (status);
 }
 
 // main -
 //    Main program which loops reading commands until end of file.
+//    Scripts, whether named by -b or redirected into stdin, are run
+//    by run_batch instead of the interactive loop, and with -s there
+//    is no loop here at all, since run_server runs one per session.
 
 int main (int argc, char** argv) {
    execname (argv[0]);
    cout << boolalpha;  // Print false or true instead of 0 or 1.
    cerr << boolalpha;
    cout << argv[0] << " build " << __DATE__ << " " << __TIME__ << endl;
-   scan_options (argc, argv);
+   yshell_options options = scan_options (argc, argv);
    bool need_echo = want_echo();
    inode_state state;
+   if (not options.image_file.empty()) {
+      try {
+         state.reset (inode_table::load (options.image_file));
+      }catch (file_error& error) {
+         complain() << error.what() << endl;
+      }
+   }
+   if (not options.journal_file.empty()) {
+      try {
+         journal::open (state, options.journal_file);
+      }catch (file_error& error) {
+         complain() << error.what() << endl;
+      }
+   }
    try {
+      if (not options.socket_path.empty()) {
+         try {
+            run_server (state, options.socket_path);
+         }catch (file_error& error) {
+            complain() << error.what() << endl;
+         }
+         return finish (state, options);
+      }
+      if (not options.batch_file.empty()) {
+         int fd = open (options.batch_file.c_str(), O_RDONLY);
+         if (fd < 0) {
+            complain() << options.batch_file << ": "
+                       << strerror (errno) << endl;
+            return finish (state, options);
+         }
+         run_batch (state, fd, need_echo);
+         close (fd);
+         return finish (state, options);
+      }
+      constexpr int CIN_FD {0};
+      if (not isatty (CIN_FD)) {
+         run_batch (state, CIN_FD, need_echo);
+         return finish (state, options);
+      }
+      tokenizer line_tokenizer;
+      output_buffer output (cout, STDOUT_FILENO, flush_policy::AT_PROMPT);
       for (;;) {
          try {
             // Read a line, break at EOF, and echo print the prompt
             // if one is needed.
+            journal::wait_durable();
             cout << state.prompt();
+            output.at_prompt();
             string line;
             getline (cin, line);
             if (cin.eof()) {
@@ -65,15 +181,18 @@ int main (int argc, char** argv) {
 
             // Split the line into words and lookup the appropriate
             // function.  Complain or call it.
-            wordvec words = split (line, " \t");
+            wordspan words = line_tokenizer.split (line);
             DEBUGF ('y', "words = " << words);
             if (words.size() > 0 and words.at(0).at(0) != '#') {
-               command_fn fn = find_command_fn (words.at(0));
-               fn (state, words);
+               run_command (state, words);
             }
          }catch (command_error& error) {
             // If there is a problem discovered in any function, an
             // exn is thrown and printed here.
+            output.drain();
+            complain() << error.what() << endl;
+         }catch (file_error& error) {
+            output.drain();
             complain() << error.what() << endl;
          }
       }
@@ -81,6 +200,6 @@ int main (int argc, char** argv) {
       // This catch intentionally left blank.
    }
 
-   return exit_status_message();
+   return finish (state, options);
 }
 
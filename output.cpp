@@ -0,0 +1,104 @@
+// $Id: output.cpp,v 1.1 2026-10-16 13:05:12-07 - - $
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+#include "output.h"
+
+output_buffer::output_buffer (ostream& out, int out_fd,
+                              flush_policy flush, size_t buffer_size):
+               buffer (buffer_size), base_size (buffer_size),
+               fd (out_fd), policy (flush),
+               stream (out) {
+   stream.flush();
+   setp (buffer.data(), buffer.data() + buffer.size());
+   saved = stream.rdbuf (this);
+}
+
+output_buffer::~output_buffer() {
+   drain();
+   stream.rdbuf (saved);
+}
+
+void output_buffer::write_all (int fd, const char* data, size_t left) {
+   while (left > 0) {
+      ssize_t written = write (fd, data, left);
+      if (written < 0) {
+         if (errno == EINTR) continue;
+         break;
+      }
+      data += written;
+      left -= written;
+   }
+}
+
+void output_buffer::drain() {
+   write_all (fd, pbase(), pptr() - pbase());
+   setp (buffer.data(), buffer.data() + buffer.size());
+}
+
+void output_buffer::at_prompt() {
+   if (policy == flush_policy::AT_THRESHOLD) return;
+   drain();
+   if (buffer.size() > base_size) {
+      buffer.resize (base_size);
+      buffer.shrink_to_fit();
+      setp (buffer.data(), buffer.data() + buffer.size());
+   }
+}
+
+// Makes room for needed more characters, keeping those pending.
+void output_buffer::grow (size_t needed) {
+   size_t used = pptr() - pbase();
+   size_t size = buffer.size();
+   while (size - used < needed) size *= 2;
+   buffer.resize (size);
+   setp (buffer.data(), buffer.data() + buffer.size());
+   pbump (used);
+}
+
+output_buffer::int_type output_buffer::overflow (int_type ch) {
+   if (policy == flush_policy::ONLY_AT_PROMPT) grow (1);
+                                          else drain();
+   if (not traits_type::eq_int_type (ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type (ch);
+      pbump (1);
+   }
+   return traits_type::not_eof (ch);
+}
+
+streamsize output_buffer::xsputn (const char* data, streamsize size) {
+   if (policy == flush_policy::ONLY_AT_PROMPT
+       and size > epptr() - pptr()) grow (size);
+   if (size > epptr() - pptr()) drain();
+   if (size > epptr() - pptr()) {
+      // Too big to ever fit, so bypass the buffer.
+      write_all (fd, data, size);
+      return size;
+   }
+   memcpy (pptr(), data, size);
+   pbump (size);
+   return size;
+}
+
+int output_buffer::sync() {
+   if (policy == flush_policy::ONLY_AT_PROMPT) return 0;
+   if (static_cast<size_t> (pptr() - pbase()) >= buffer.size() / 2) {
+      drain();
+   }
+   return 0;
+}
+
+char* format_padded (char* end, size_t value, size_t width) {
+   char* first = end;
+   do {
+      *--first = '0' + value % 10;
+      value /= 10;
+   }while (value != 0);
+   while (static_cast<size_t> (end - first) < width) *--first = ' ';
+   return first;
+}
+
@@ -0,0 +1,74 @@
+// $Id: output.h,v 1.1 2026-10-16 13:05:12-07 - - $
+
+// output -
+//    Buffered standard output for the command loops.  Commands write
+//    to cout as always; while an output_buffer is installed, that
+//    lands in one large buffer which is written with write(2) at
+//    points chosen by the flush policy instead of at every endl.
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <cstddef>
+#include <iostream>
+#include <streambuf>
+#include <vector>
+using namespace std;
+
+// flush_policy -
+//    AT_PROMPT writes the buffer out whenever the loop is about to
+//    wait for the user, so an interactive session sees every result
+//    before its next prompt.  AT_THRESHOLD writes it out only once it
+//    passes half its size, which is what batch mode wants.
+//    ONLY_AT_PROMPT never writes in the middle of a command at all:
+//    the buffer grows instead, and shrinks back at the prompt, so a
+//    session of a server never waits on a slow client while it holds
+//    the filesystem lock.
+//
+// output_buffer -
+//    A streambuf with one large buffer that installs itself as the
+//    buffer of a stream for its lifetime.  sync, which endl calls,
+//    writes the buffer out only past half its size.  at_prompt
+//    applies the flush policy, and drain writes out whatever is
+//    pending, as must be done before writing anything to cerr.  The
+//    buffer is BUFFER_SIZE unless a size is given, as the sessions
+//    of a server do to keep many of them small.
+
+enum class flush_policy {AT_PROMPT, AT_THRESHOLD, ONLY_AT_PROMPT};
+
+class output_buffer: public streambuf {
+   private:
+      vector<char> buffer;
+      size_t base_size;
+      int fd;
+      flush_policy policy;
+      ostream& stream;
+      streambuf* saved;
+      void grow (size_t needed);
+   protected:
+      virtual int_type overflow (int_type ch) override;
+      virtual streamsize xsputn (const char* data, streamsize size)
+                                override;
+      virtual int sync() override;
+   public:
+      static constexpr size_t BUFFER_SIZE {1 << 20};
+      output_buffer (ostream& stream, int fd, flush_policy policy,
+                     size_t buffer_size = BUFFER_SIZE);
+      ~output_buffer();
+      output_buffer (const output_buffer&) = delete;
+      output_buffer& operator= (const output_buffer&) = delete;
+      void at_prompt();
+      void drain();
+      static void write_all (int fd, const char* data, size_t size);
+};
+
+// format_padded -
+//    Formats value right-aligned in a field of width characters,
+//    padded on the left with spaces, ending just before end.  Wider
+//    values take as many characters as they need.  Returns a pointer
+//    to the first character written.
+
+char* format_padded (char* end, size_t value, size_t width);
+
+#endif
+
@@ -0,0 +1,197 @@
+// $Id: server.cpp,v 1.1 2026-10-16 17:40:05-07 - - $
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <thread>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "commands.h"
+#include "debug.h"
+#include "journal.h"
+#include "output.h"
+#include "server.h"
+
+/*** SESSIONS ***/
+// Sessions print less than a script, and there may be many of them.
+static constexpr size_t SESSION_BUFFER {1 << 16};
+
+// A connected client.  The server owns the socket and closes it
+// only after joining the thread, which it does when the next client
+// connects, so the descriptor cannot be reused while the session or
+// a shutdown might still use it.
+struct session {
+   int fd;
+   thread worker;
+   atomic<bool> done {false};
+};
+
+// Reads the next line from the socket into line, without its
+// newline or a carriage return before it, keeping whatever was read
+// past it in pending.  Returns false at end of file with nothing
+// left over.
+static bool read_line (int fd, string& pending, string& line) {
+   size_t scanned = 0;
+   for (;;) {
+      size_t newline = pending.find ('\n', scanned);
+      if (newline != string::npos) {
+         size_t length = newline;
+         if (length > 0 and pending[length - 1] == '\r') --length;
+         line.assign (pending, 0, length);
+         pending.erase (0, newline + 1);
+         return true;
+      }
+      scanned = pending.size();
+      char block[4096];
+      ssize_t got = read (fd, block, sizeof block);
+      if (got < 0 and errno == EINTR) continue;
+      if (got <= 0) {
+         if (pending.empty()) return false;
+         line = move (pending);
+         pending.clear();
+         return true;
+      }
+      pending.append (block, got);
+   }
+}
+
+// The command loop of one session, which is the interactive loop of
+// main with the session's own state and output.
+static void run_session (inode_state& server_state, session& client) {
+   unique_ptr<inode_state> state;
+   {
+      shared_lock<shared_mutex> reading (filesystem_lock());
+      state = make_unique<inode_state> (server_state.get_root());
+   }
+   ostream out (nullptr);
+   out << boolalpha;
+   output_buffer output (out, client.fd, flush_policy::ONLY_AT_PROMPT,
+                         SESSION_BUFFER);
+   state->set_output (out);
+   DEBUGF ('s', "session " << client.fd << " started");
+
+   tokenizer line_tokenizer;
+   string pending;
+   string line;
+   for (;;) {
+      journal::wait_durable();
+      out << state->prompt();
+      output.at_prompt();
+      if (not read_line (client.fd, pending, line)) break;
+      wordspan words = line_tokenizer.split (line);
+      DEBUGF ('s', "session " << client.fd << " words = " << words);
+      if (words.size() == 0 or words.at(0).at(0) == '#') continue;
+      try {
+         run_command (*state, words);
+      }catch (command_error& error) {
+         out << execname() << ": " << error.what() << '\n';
+      }catch (file_error& error) {
+         out << execname() << ": " << error.what() << '\n';
+      }catch (ysh_exit&) {
+         break;
+      }
+   }
+   // Hang up now, though the descriptor stays open until reaped.
+   output.drain();
+   shutdown (client.fd, SHUT_RDWR);
+   DEBUGF ('s', "session " << client.fd << " ended");
+   client.done = true;
+}
+
+/*** LISTENER ***/
+static int listen_on (const string& socket_path) {
+   sockaddr_un address {};
+   address.sun_family = AF_UNIX;
+   if (socket_path.size() >= sizeof address.sun_path) {
+      throw file_error (socket_path + ": socket path too long");
+   }
+   memcpy (address.sun_path, socket_path.c_str(), socket_path.size());
+   int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (fd < 0) throw file_error (string ("socket: ") + strerror (errno));
+   unlink (socket_path.c_str());
+   if (bind (fd, reinterpret_cast<sockaddr*> (&address),
+             sizeof address) != 0
+       or listen (fd, SOMAXCONN) != 0) {
+      int error = errno;
+      close (fd);
+      throw file_error (socket_path + ": " + strerror (error));
+   }
+   return fd;
+}
+
+// Joins the sessions that have ended and closes their sockets.
+static void reap (list<session>& sessions, bool all) {
+   for (auto client = sessions.begin(); client != sessions.end();) {
+      if (not all and not client->done) {
+         ++client;
+         continue;
+      }
+      client->worker.join();
+      close (client->fd);
+      client = sessions.erase (client);
+   }
+}
+
+void run_server (inode_state& state, const string& socket_path) {
+   int listen_fd = listen_on (socket_path);
+
+   // Take SIGINT and SIGTERM as events rather than deaths, in every
+   // thread, since sessions inherit the mask.  A client that hangs
+   // up while being written to is just a failed write.
+   sigset_t stop_signals;
+   sigemptyset (&stop_signals);
+   sigaddset (&stop_signals, SIGINT);
+   sigaddset (&stop_signals, SIGTERM);
+   sigset_t saved_signals;
+   pthread_sigmask (SIG_BLOCK, &stop_signals, &saved_signals);
+   signal (SIGPIPE, SIG_IGN);
+   int signal_fd = signalfd (-1, &stop_signals,
+                            SFD_NONBLOCK | SFD_CLOEXEC);
+
+   list<session> sessions;
+   DEBUGF ('s', "listening on " << socket_path);
+   for (;;) {
+      pollfd waiting[] {{listen_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+      if (poll (waiting, signal_fd < 0 ? 1 : 2, -1) < 0) {
+         if (errno == EINTR) continue;
+         complain() << "poll: " << strerror (errno) << endl;
+         break;
+      }
+      if (waiting[1].revents != 0) break;
+      reap (sessions, false);
+      int fd = accept4 (listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) continue;
+      session& client = sessions.emplace_back();
+      client.fd = fd;
+      client.worker = thread (run_session, ref (state), ref (client));
+   }
+
+   // Shutting the sockets down makes every session read end of file
+   // at its next line, after finishing the command it is running.
+   DEBUGF ('s', "stopping " << sessions.size() << " sessions");
+   close (listen_fd);
+   unlink (socket_path.c_str());
+   for (session& client: sessions) shutdown (client.fd, SHUT_RDWR);
+   reap (sessions, true);
+
+   // Take the signal that stopped us, or it would be delivered, and
+   // kill the process, as soon as the mask is restored.
+   if (signal_fd >= 0) {
+      signalfd_siginfo info;
+      if (read (signal_fd, &info, sizeof info) != sizeof info) {
+         DEBUGF ('s', "no signal pending");
+      }
+      close (signal_fd);
+   }
+   pthread_sigmask (SIG_SETMASK, &saved_signals, nullptr);
+}
+
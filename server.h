@@ -0,0 +1,34 @@
+// $Id: server.h,v 1.1 2026-10-16 17:40:05-07 - - $
+
+// server -
+//    Serves many sessions at once over a Unix domain socket, all on
+//    one shared filesystem, instead of one process per user each
+//    building its own tree.  Each connection is a session with its
+//    own current directory, prompt and output, run by a thread of
+//    its own.  Commands go through run_command, so sessions that only
+//    read the filesystem run in parallel under the filesystem_lock.
+//    Any client that speaks lines will do, for example
+//       socat - UNIX-CONNECT:/tmp/yshell.sock
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <string>
+using namespace std;
+
+#include "file_sys.h"
+
+// run_server -
+//    Listens on the socket path, replacing a stale socket left there,
+//    and serves sessions on the root of state until SIGINT or SIGTERM
+//    arrives.  Then it stops accepting, ends every session as if its
+//    client had hung up, waits for them and removes the socket.
+//    Sessions see no echo and get errors on their own output.  exit
+//    ends only the session that runs it, though its status is still
+//    the one the server exits with.  Throws a file_error if the
+//    socket cannot be set up.
+
+void run_server (inode_state& state, const string& socket_path);
+
+#endif
+
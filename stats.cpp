@@ -0,0 +1,216 @@
+// $Id: stats.cpp,v 1.1 2026-10-16 14:22:48-07 - - $
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <new>
+#if defined (__x86_64__) or defined (__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+#include "stats.h"
+#include "util.h"
+
+/*** ALLOCATION COUNTING ***/
+// Every allocation in the process goes through here.  Each thread
+// keeps its own count, since it is only ever read as a difference on
+// one thread, and that way a command is charged only for its own.
+
+static thread_local uint64_t allocation_count {0};
+
+void* operator new (size_t size) {
+   ++allocation_count;
+   void* block = malloc (size == 0 ? 1 : size);
+   if (block == nullptr) throw bad_alloc();
+   return block;
+}
+
+void operator delete (void* block) noexcept {
+   free (block);
+}
+
+void operator delete (void* block, size_t) noexcept {
+   free (block);
+}
+
+/*** HISTOGRAM ***/
+size_t histogram::bucket_of (uint64_t value) {
+   if (value < SUB_BUCKETS) return value;
+   size_t exponent = 63 - __builtin_clzll (value);
+   size_t sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+   return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t histogram::bucket_top (size_t bucket) {
+   if (bucket < SUB_BUCKETS) return bucket;
+   size_t shift = bucket / SUB_BUCKETS - 1;
+   uint64_t sub = bucket % SUB_BUCKETS;
+   uint64_t width = uint64_t {1} << shift;
+   return ((SUB_BUCKETS + sub) << shift) + (width - 1);
+}
+
+void histogram::record (uint64_t value) {
+   buckets[bucket_of (value)].fetch_add (1, memory_order_relaxed);
+   total.fetch_add (1, memory_order_relaxed);
+   sum.fetch_add (value, memory_order_relaxed);
+   uint64_t seen = largest.load (memory_order_relaxed);
+   while (value > seen and not largest.compare_exchange_weak (
+                               seen, value, memory_order_relaxed)) {
+      continue;
+   }
+}
+
+double histogram::mean() const {
+   uint64_t count = this->count();
+   if (count == 0) return 0;
+   return static_cast<double> (sum.load (memory_order_relaxed)) / count;
+}
+
+// Totals are read once, so a value recorded during the scan can only
+// make it stop early, at the largest value.
+uint64_t histogram::value_at (double fraction) const {
+   uint64_t count = this->count();
+   uint64_t top = max();
+   if (count == 0) return 0;
+   uint64_t wanted = ceil (fraction * count);
+   if (wanted < 1) wanted = 1;
+   uint64_t seen = 0;
+   for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+      seen += buckets[bucket].load (memory_order_relaxed);
+      if (seen >= wanted) return min (bucket_top (bucket), top);
+   }
+   return top;
+}
+
+/*** STATS ***/
+histogram stats::path_depth;
+histogram stats::dir_sizes;
+histogram stats::file_sizes;
+atomic<uint64_t> stats::cached_paths {0};
+atomic<uint64_t> stats::file_bytes {0};
+string stats::json_file;
+
+uint64_t stats::cycles() {
+#if defined (__x86_64__) or defined (__i386__)
+   return __rdtsc();
+#else
+   return chrono::duration_cast<chrono::nanoseconds> (
+          chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint64_t stats::allocations() {
+   return allocation_count;
+}
+
+// The cycle counter is calibrated against the steady clock over the
+// life of the process, or over a short wait if that has been too
+// short to measure.
+static const auto start_time = chrono::steady_clock::now();
+static const uint64_t start_cycles = stats::cycles();
+
+double stats::nanoseconds_per_cycle() {
+   using namespace chrono;
+   auto now = steady_clock::now();
+   uint64_t cycles = stats::cycles();
+   if (now - start_time < milliseconds (10)) {
+      auto until = now + milliseconds (10);
+      while (steady_clock::now() < until) continue;
+      now = steady_clock::now();
+      cycles = stats::cycles();
+   }
+   double elapsed = duration<double, nano> (now - start_time).count();
+   if (cycles <= start_cycles) return 1;
+   return elapsed / (cycles - start_cycles);
+}
+
+static uint64_t to_ns (uint64_t cycles, double scale) {
+   return cycles * scale + 0.5;
+}
+
+void stats::print (ostream& out, const vector<named_metrics>& commands) {
+   double scale = nanoseconds_per_cycle();
+   streamsize precision = out.precision();
+   out << left << setw (11) << "command" << right
+       << setw (9) << "calls" << setw (9) << "failed"
+       << setw (10) << "p50 ns" << setw (10) << "p90 ns"
+       << setw (10) << "p99 ns" << setw (10) << "max ns"
+       << setw (10) << "allocs" << '\n';
+   for (const named_metrics& command: commands) {
+      const command_metrics& metrics = *command.metrics;
+      if (metrics.calls == 0) continue;
+      const histogram& cycles = metrics.cycles;
+      out << left << setw (11) << command.name << right
+          << setw (9) << metrics.calls << setw (9) << metrics.failures
+          << setw (10) << to_ns (cycles.value_at (0.50), scale)
+          << setw (10) << to_ns (cycles.value_at (0.90), scale)
+          << setw (10) << to_ns (cycles.value_at (0.99), scale)
+          << setw (10) << to_ns (cycles.max(), scale)
+          << setw (10) << fixed << setprecision (1)
+          << static_cast<double> (metrics.allocations) / metrics.calls
+          << defaultfloat << setprecision (precision) << '\n';
+   }
+   auto print_histogram = [&out] (const char* name,
+                                  const histogram& values) {
+      out << name << ": " << values.count() << " recorded, p50 "
+          << values.value_at (0.50) << ", p99 " << values.value_at (0.99)
+          << ", max " << values.max() << '\n';
+   };
+   print_histogram ("path depth", path_depth);
+   out << "paths from dentry cache: " << cached_paths << '\n';
+   print_histogram ("directory entries", dir_sizes);
+   print_histogram ("file bytes", file_sizes);
+   out << "file bytes written: " << file_bytes << '\n';
+}
+
+static void json_histogram (ostream& out, const histogram& values,
+                            double scale) {
+   out << "{\"count\":" << values.count()
+       << ",\"p50\":" << to_ns (values.value_at (0.50), scale)
+       << ",\"p90\":" << to_ns (values.value_at (0.90), scale)
+       << ",\"p99\":" << to_ns (values.value_at (0.99), scale)
+       << ",\"max\":" << to_ns (values.max(), scale) << "}";
+}
+
+void stats::write_json (ostream& out,
+                        const vector<named_metrics>& commands) {
+   double scale = nanoseconds_per_cycle();
+   out << "{\"commands\":{";
+   bool first = true;
+   for (const named_metrics& command: commands) {
+      const command_metrics& metrics = *command.metrics;
+      if (metrics.calls == 0) continue;
+      if (not first) out << ",";
+      first = false;
+      out << "\"" << command.name << "\":{\"calls\":" << metrics.calls
+          << ",\"failures\":" << metrics.failures
+          << ",\"allocations\":" << metrics.allocations
+          << ",\"ns\":";
+      json_histogram (out, metrics.cycles, scale);
+      out << "}";
+   }
+   out << "},\"path_depth\":";
+   json_histogram (out, path_depth, 1);
+   out << ",\"cached_paths\":" << cached_paths
+       << ",\"directory_entries\":";
+   json_histogram (out, dir_sizes, 1);
+   out << ",\"file_bytes\":";
+   json_histogram (out, file_sizes, 1);
+   out << ",\"file_bytes_written\":" << file_bytes << "}\n";
+}
+
+void stats::set_json_file (const string& filename) {
+   json_file = filename;
+}
+
+void stats::dump_json_file (const vector<named_metrics>& commands) {
+   if (json_file.empty()) return;
+   ofstream out (json_file);
+   write_json (out, commands);
+   if (not out) complain() << json_file << ": cannot write stats" << endl;
+}
+
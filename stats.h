@@ -0,0 +1,135 @@
+// $Id: stats.h,v 1.1 2026-10-16 14:22:48-07 - - $
+
+// stats -
+//    Cheap always-on instrumentation:  per-command call counts,
+//    latency histograms and allocation counts, plus histograms of
+//    path depth, directory size and file size.  Printed by the stats
+//    command, and dumped as JSON at exit if asked for with -j.
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+using namespace std;
+
+// histogram -
+//    Log-linear buckets in the manner of HdrHistogram:  each power of
+//    two is split into SUB_BUCKETS equal parts, so any recorded value
+//    is known to within one part in SUB_BUCKETS whatever its size,
+//    and recording is a count leading zeros and an increment.  The
+//    counts are relaxed atomics, so sessions of a server can record
+//    into one histogram at once.
+// record -
+//    Adds one value.
+// value_at -
+//    The smallest value that at least the given fraction of the
+//    recorded values are no larger than, to the precision of the
+//    buckets.
+
+class histogram {
+   private:
+      static constexpr size_t SUB_BITS {3};
+      static constexpr size_t SUB_BUCKETS {1 << SUB_BITS};
+      static constexpr size_t BUCKETS {(65 - SUB_BITS) * SUB_BUCKETS};
+      array<atomic<uint64_t>,BUCKETS> buckets {};
+      atomic<uint64_t> total {0};
+      atomic<uint64_t> sum {0};
+      atomic<uint64_t> largest {0};
+      static size_t bucket_of (uint64_t value);
+      static uint64_t bucket_top (size_t bucket);
+   public:
+      void record (uint64_t value);
+      uint64_t count() const {
+         return total.load (memory_order_relaxed);
+      }
+      uint64_t max() const {
+         return largest.load (memory_order_relaxed);
+      }
+      double mean() const;
+      uint64_t value_at (double fraction) const;
+};
+
+// command_metrics -
+//    What is known about one command:  how often it ran, how often it
+//    failed, how many cycles each call took and how many heap
+//    allocations the calls made in all.
+// named_metrics -
+//    A command's name with its metrics, for printing.
+
+struct command_metrics {
+   atomic<uint64_t> calls {0};
+   atomic<uint64_t> failures {0};
+   atomic<uint64_t> allocations {0};
+   histogram cycles;
+};
+
+struct named_metrics {
+   string_view name;
+   const command_metrics* metrics;
+};
+
+// stats -
+//    A static class holding the counters that are not per command.
+// cycles -
+//    A cycle counter, rdtsc where there is one and a nanosecond clock
+//    otherwise, converted to time only when printing.
+// nanoseconds_per_cycle -
+//    The rate of the cycle counter, measured against the steady
+//    clock since startup.
+// allocations -
+//    The number of calls to operator new made by the calling thread
+//    since it started.  This module replaces the global operator new
+//    to count them.
+// record_path -
+//    Called by the resolver with the number of directory components
+//    in a path and whether the dentry_cache already knew the answer.
+// record_dir_size, record_write -
+//    Called with the number of entries in a directory after mkdir or
+//    mkfile adds one, and the size of a file after a write.
+// print -
+//    Prints the commands that have run and the other histograms.
+// write_json -
+//    The same as one JSON object.
+// set_json_file, dump_json_file -
+//    Names a file to write the JSON to at exit, and writes it there
+//    if one was named.
+
+class stats {
+   private:
+      static histogram path_depth;
+      static histogram dir_sizes;
+      static histogram file_sizes;
+      static atomic<uint64_t> cached_paths;
+      static atomic<uint64_t> file_bytes;
+      static string json_file;
+   public:
+      static uint64_t cycles();
+      static double nanoseconds_per_cycle();
+      static uint64_t allocations();
+      static void record_path (size_t depth, bool cached) {
+         path_depth.record (depth);
+         if (cached) cached_paths.fetch_add (1, memory_order_relaxed);
+      }
+      static void record_dir_size (size_t entries) {
+         dir_sizes.record (entries);
+      }
+      static void record_write (size_t bytes) {
+         file_sizes.record (bytes);
+         file_bytes.fetch_add (bytes, memory_order_relaxed);
+      }
+      static void print (ostream& out,
+                         const vector<named_metrics>& commands);
+      static void write_json (ostream& out,
+                              const vector<named_metrics>& commands);
+      static void set_json_file (const string& filename);
+      static void dump_json_file (const vector<named_metrics>& commands);
+};
+
+#endif
+
@@ -0,0 +1,91 @@
+// $Id: traverse.cpp,v 1.1 2026-10-16 10:02:17-07 - - $
+
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#include "debug.h"
+#include "traverse.h"
+#include "util.h"
+
+// print_unit -
+//    A piece of the output of print_tree: either the listing of dir
+//    alone, or the listings of dir and everything below it.
+
+struct print_unit {
+   inode_ptr dir;
+   bool whole_subtree;
+};
+
+// Units are formatted this many at a time, which bounds how much of
+// the output is held in memory at once.
+static constexpr size_t WINDOW_UNITS {256};
+
+static vector<inode_ptr> child_directories (inode_ptr dir) {
+   vector<inode_ptr> children;
+   for (dirent_view child: dir->sorted_children()) {
+      if (child.type != file_type::DIRECTORY_TYPE) continue;
+      if (child.name == "." or child.name == "..") continue;
+      children.push_back (child.node);
+   }
+   return children;
+}
+
+static void print_subtree (ostream& out, inode_ptr dir) {
+   out << *dir << '\n';
+   for (inode_ptr child: child_directories (dir)) {
+      print_subtree (out, child);
+   }
+}
+
+// Splits whole subtrees into their own listing followed by their
+// children's subtrees, a level at a time, until there are enough
+// units to keep every thread busy.
+static vector<print_unit> split_units (inode_ptr dir, size_t target) {
+   vector<print_unit> units {{dir, true}};
+   bool changed = true;
+   while (changed and units.size() < target) {
+      changed = false;
+      vector<print_unit> split;
+      for (const print_unit& unit: units) {
+         if (not unit.whole_subtree) {
+            split.push_back (unit);
+            continue;
+         }
+         vector<inode_ptr> children = child_directories (unit.dir);
+         split.push_back ({unit.dir, children.empty()});
+         for (inode_ptr child: children) split.push_back ({child, true});
+         if (not children.empty()) changed = true;
+      }
+      units.swap (split);
+   }
+   return units;
+}
+
+void print_tree (ostream& out, inode_ptr dir) {
+   size_t threads = thread::hardware_concurrency();
+   if (threads <= 1) {
+      print_subtree (out, dir);
+      return;
+   }
+
+   vector<print_unit> units = split_units (dir, 8 * threads);
+   TRACE ('t', "print_tree units, threads", units.size(), threads);
+   vector<string> buffers;
+   for (size_t start = 0; start < units.size(); start += WINDOW_UNITS) {
+      size_t count = min (WINDOW_UNITS, units.size() - start);
+      buffers.assign (count, string());
+      parallel_for (count, [&] (size_t index) {
+         const print_unit& unit = units[start + index];
+         ostringstream buffer;
+         if (unit.whole_subtree) print_subtree (buffer, unit.dir);
+                            else buffer << *unit.dir << '\n';
+         buffers[index] = buffer.str();
+      }, 1);
+      for (const string& buffer: buffers) out << buffer;
+   }
+}
+
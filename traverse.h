@@ -0,0 +1,26 @@
+// $Id: traverse.h,v 1.1 2026-10-16 10:02:17-07 - - $
+
+// traverse -
+//    Whole subtree walks, spread over the hardware threads.
+
+#ifndef __TRAVERSE_H__
+#define __TRAVERSE_H__
+
+#include <iostream>
+using namespace std;
+
+#include "file_sys.h"
+
+// print_tree -
+//    Prints a directory followed by all of the directories below it,
+//    depth first in lexicographic order, each as ls would.  The tree
+//    is cut into a sequence of units, each either a single listing
+//    or a whole subtree.  Threads claim units as they free up and
+//    format them into their own buffers, which are then written out
+//    in sequence order, so the output is exactly what a sequential
+//    walk would produce.
+
+void print_tree (ostream& out, inode_ptr dir);
+
+#endif
+
@@ -1,14 +1,24 @@
 // $Id: util.cpp,v 1.11 2016-01-13 16:21:53-08 - - $
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 #include "util.h"
 #include "debug.h"
 
-int exit_status::status = EXIT_SUCCESS;
+atomic<int> exit_status::status {EXIT_SUCCESS};
 static string execname_string;
 
 void exit_status::set (int new_status) {
@@ -50,10 +60,211 @@ wordvec split (const string& line, const string& delimiters) {
       end = line.find_first_of (delimiters, start);
       words.push_back (line.substr (start, end - start));
    }
-   DEBUGF ('u', words);
+   TRACE ('u', "split words", words.size());
    return words;
 }
 
+// One call to parallel_for.  Its indices are handed out through
+// next, and helpers counts the pool threads working on it, so the
+// caller knows when it may return.
+struct parallel_job {
+   size_t count {0};
+   size_t grain {1};
+   const function<void(size_t)>* fn {nullptr};
+   size_t wanted {0};
+   size_t helpers {0};
+   atomic<size_t> next {0};
+   exception_ptr failure;
+   mutex failure_lock;
+   void run();
+};
+
+void parallel_job::run() {
+   try {
+      for (;;) {
+         size_t begin = next.fetch_add (grain);
+         if (begin >= count) break;
+         size_t end = min (begin + grain, count);
+         for (size_t index = begin; index < end; ++index) (*fn) (index);
+      }
+   }catch (...) {
+      lock_guard<mutex> guard (failure_lock);
+      if (not failure) failure = current_exception();
+      next = count;
+   }
+}
+
+// The helper threads, started the first time there is work to share
+// and kept for the life of the process.  A job stays queued until
+// as many helpers as it wants have joined it or its caller is done
+// with it.  The caller always works on its own job, so a job makes
+// progress even when every helper is busy with another session's,
+// and a parallel_for nested in another cannot deadlock.  Like the
+// filesystem, the pool is abandoned at exit rather than torn down.
+class worker_pool {
+   private:
+      mutex lock;
+      condition_variable work;
+      condition_variable done;
+      deque<parallel_job*> jobs;
+      void serve();
+   public:
+      explicit worker_pool (size_t workers);
+      void run (parallel_job& job);
+};
+
+worker_pool::worker_pool (size_t workers) {
+   for (size_t worker = 0; worker < workers; ++worker) {
+      thread (&worker_pool::serve, this).detach();
+   }
+}
+
+void worker_pool::serve() {
+   unique_lock<mutex> guard (lock);
+   for (;;) {
+      work.wait (guard, [this] { return not jobs.empty(); });
+      parallel_job* job = jobs.front();
+      if (++job->helpers == job->wanted) jobs.pop_front();
+      guard.unlock();
+      job->run();
+      guard.lock();
+      if (--job->helpers == 0) done.notify_all();
+   }
+}
+
+void worker_pool::run (parallel_job& job) {
+   {
+      lock_guard<mutex> guard (lock);
+      jobs.push_back (&job);
+   }
+   work.notify_all();
+   job.run();
+   unique_lock<mutex> guard (lock);
+   auto queued = find (jobs.begin(), jobs.end(), &job);
+   if (queued != jobs.end()) jobs.erase (queued);
+   done.wait (guard, [&job] { return job.helpers == 0; });
+}
+
+void parallel_for (size_t count, const function<void(size_t)>& fn,
+                   size_t grain) {
+   if (grain == 0) grain = 1;
+   size_t chunks = (count + grain - 1) / grain;
+   size_t cores = thread::hardware_concurrency();
+   size_t threads = min<size_t> (cores, chunks);
+   if (threads <= 1) {
+      for (size_t index = 0; index < count; ++index) fn (index);
+      return;
+   }
+
+   static worker_pool* pool = new worker_pool (cores - 1);
+   parallel_job job;
+   job.count = count;
+   job.grain = grain;
+   job.fn = &fn;
+   job.wanted = threads - 1;
+   pool->run (job);
+   TRACE ('u', "parallel_for items, threads", count, threads);
+   if (job.failure) rethrow_exception (job.failure);
+}
+
+delimiter_set::delimiter_set (string_view chars) {
+   for (char ch: chars) table[static_cast<unsigned char> (ch)] = true;
+   if (chars.size() <= 2) {
+      for (char ch: chars) simd_chars[simd_count++] = ch;
+   }
+}
+
+const delimiter_set WHITESPACE {" \t"};
+const delimiter_set SLASH {"/"};
+
+#ifdef __SSE2__
+// Returns a bit for each of the sixteen bytes at text that is one of
+// the delimiters in the list.
+static inline unsigned delimiter_mask (const char* text,
+                                       const char* chars,
+                                       size_t count) {
+   __m128i block = _mm_loadu_si128 (
+                   reinterpret_cast<const __m128i*> (text));
+   __m128i hits = _mm_cmpeq_epi8 (block, _mm_set1_epi8 (chars[0]));
+   if (count == 2) {
+      hits = _mm_or_si128 (hits,
+             _mm_cmpeq_epi8 (block, _mm_set1_epi8 (chars[1])));
+   }
+   return _mm_movemask_epi8 (hits);
+}
+#endif
+
+size_t find_delimiter (string_view text, size_t pos,
+                       const delimiter_set& delimiters) {
+   if (pos >= text.size()) return string_view::npos;
+#ifdef __SSE2__
+   if (delimiters.simd_count > 0) {
+      for (; pos + 16 <= text.size(); pos += 16) {
+         unsigned mask = delimiter_mask (text.data() + pos,
+                                         delimiters.simd_chars,
+                                         delimiters.simd_count);
+         if (mask != 0) return pos + __builtin_ctz (mask);
+      }
+   }
+#endif
+   for (; pos < text.size(); ++pos) {
+      if (delimiters.contains (text[pos])) return pos;
+   }
+   return string_view::npos;
+}
+
+size_t skip_delimiters (string_view text, size_t pos,
+                        const delimiter_set& delimiters) {
+   if (pos >= text.size()) return string_view::npos;
+#ifdef __SSE2__
+   if (delimiters.simd_count > 0) {
+      for (; pos + 16 <= text.size(); pos += 16) {
+         unsigned mask = ~delimiter_mask (text.data() + pos,
+                                          delimiters.simd_chars,
+                                          delimiters.simd_count)
+                       & 0xFFFF;
+         if (mask != 0) return pos + __builtin_ctz (mask);
+      }
+   }
+#endif
+   for (; pos < text.size(); ++pos) {
+      if (not delimiters.contains (text[pos])) return pos;
+   }
+   return string_view::npos;
+}
+
+wordspan tokenizer::split (string_view line,
+                           const delimiter_set& delimiters) {
+   size_t count = 0;
+   spilled.clear();
+   size_t end = 0;
+   for (;;) {
+      size_t start = skip_delimiters (line, end, delimiters);
+      if (start == string_view::npos) break;
+      end = find_delimiter (line, start, delimiters);
+      string_view token = line.substr (start, end - start);
+      if (count < INLINE_TOKENS) {
+         inline_tokens[count] = token;
+      } else {
+         if (count == INLINE_TOKENS) {
+            spilled.assign (inline_tokens.begin(), inline_tokens.end());
+         }
+         spilled.push_back (token);
+      }
+      ++count;
+      if (end == string_view::npos) break;
+   }
+   wordspan words = count <= INLINE_TOKENS
+                  ? wordspan (inline_tokens.data(), count)
+                  : wordspan (spilled);
+   TRACE ('u', "split words", words.size());
+   return words;
+}
+
+ostream& operator<< (ostream& out, const wordspan& words) {
+   return out << word_range (words.cbegin(), words.cend());
+}
+
 ostream& complain() {
    exit_status::set (EXIT_FAILURE);
    cerr << execname() << ": ";
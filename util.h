@@ -7,9 +7,13 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <array>
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 using namespace std;
 
@@ -19,7 +23,38 @@ template <typename iterator>
 using range_type = pair<iterator,iterator>;
 
 using wordvec = vector<string>;
-using word_range = range_type<decltype(declval<wordvec>().cbegin())>;
+
+// wordspan -
+//    A read-only view of a sequence of words, each a string_view into
+//    text owned by someone else.  This is what the tokenizer produces
+//    and what the command functions take.
+
+class wordspan {
+   private:
+      const string_view* first {nullptr};
+      size_t count {0};
+   public:
+      wordspan() = default;
+      wordspan (const string_view* words, size_t size):
+                first (words), count (size) {}
+      wordspan (const vector<string_view>& words):
+                first (words.data()), count (words.size()) {}
+      size_t size() const { return count; }
+      bool empty() const { return count == 0; }
+      const string_view& operator[] (size_t index) const {
+         return first[index];
+      }
+      const string_view& at (size_t index) const {
+         if (index >= count) throw out_of_range ("wordspan::at");
+         return first[index];
+      }
+      const string_view* begin() const { return first; }
+      const string_view* end() const { return first + count; }
+      const string_view* cbegin() const { return first; }
+      const string_view* cend() const { return first + count; }
+};
+
+using word_range = range_type<const string_view*>;
 
 // setexecname -
 //    Sets the static string to be used as an execname.
@@ -41,11 +76,11 @@ bool want_echo();
 //    A static class for maintaining the exit status.  The default
 //    status is EXIT_SUCCESS (0), but can be set to another value,
 //    such as EXIT_FAILURE (1) to indicate that error messages have
-//    been printed.
+//    been printed.  Atomic, since any session of a server may set it.
 
 class exit_status {
    private:
-      static int status;
+      static atomic<int> status;
    public:
       static void set (int);
       static int get();
@@ -58,6 +93,72 @@ class exit_status {
 
 wordvec split (const string& line, const string& delimiter);
 
+// delimiter_set -
+//    A set of delimiter chars, as a table for the general case.  Sets
+//    of one or two chars are also kept as a list, which lets the
+//    scanning functions compare sixteen bytes at a time with SSE2.
+//    WHITESPACE separates the words of a command and SLASH the
+//    components of a pathname.
+// find_delimiter -
+//    The position of the first delimiter at or after pos, or npos.
+// skip_delimiters -
+//    The position of the first non-delimiter at or after pos, or npos.
+
+class delimiter_set {
+   private:
+      array<bool,256> table {};
+      char simd_chars[2] {};
+      size_t simd_count {0};
+   public:
+      explicit delimiter_set (string_view chars);
+      bool contains (char ch) const {
+         return table[static_cast<unsigned char> (ch)];
+      }
+      friend size_t find_delimiter (string_view, size_t,
+                                    const delimiter_set&);
+      friend size_t skip_delimiters (string_view, size_t,
+                                     const delimiter_set&);
+};
+
+extern const delimiter_set WHITESPACE;
+extern const delimiter_set SLASH;
+
+size_t find_delimiter (string_view text, size_t pos,
+                       const delimiter_set& delimiters);
+size_t skip_delimiters (string_view text, size_t pos,
+                        const delimiter_set& delimiters);
+
+// tokenizer -
+//    Splits lines into string_view tokens without copying the text.
+//    The tokens go into an inline array, spilling into a vector kept
+//    from line to line only when a line has more than INLINE_TOKENS
+//    words, so a session that reuses one tokenizer does not allocate
+//    once it is warmed up.  The wordspan returned is valid until the
+//    next call to split, and only as long as the line itself is.
+
+class tokenizer {
+   private:
+      static constexpr size_t INLINE_TOKENS {16};
+      array<string_view,INLINE_TOKENS> inline_tokens;
+      vector<string_view> spilled;
+   public:
+      wordspan split (string_view line,
+                      const delimiter_set& delimiters = WHITESPACE);
+};
+
+// parallel_for -
+//    Calls fn (i) for each i in [0, count), handing out chunks of
+//    grain indices at a time to as many threads as the hardware
+//    offers, the calling thread included.  The other threads come
+//    from a pool started on first use and shared by every caller.
+//    Runs inline when there is only one thread or too little work
+//    to split.  Returns once
+//    every call has finished, rethrowing the first exception any of
+//    them threw.
+
+void parallel_for (size_t count, const function<void(size_t)>& fn,
+                   size_t grain = 64);
+
 // complain -
 //    Used for starting error messages.  Sets the exit status to
 //    EXIT_FAILURE, writes the program name to cerr, and then
@@ -82,6 +183,8 @@ ostream& operator<< (ostream& out, const vector<item_t>& vec) {
    return out;
 }
 
+ostream& operator<< (ostream& out, const wordspan& words);
+
 template <typename iterator>
 ostream& operator<< (ostream& out, range_type<iterator> range) {
    for (auto itor = range.first; itor != range.second; ++itor) {
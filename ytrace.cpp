@@ -0,0 +1,33 @@
+// $Id: ytrace.cpp,v 1.1 2026-10-16 15:10:31-07 - - $
+
+// ytrace -
+//    Decodes binary trace files saved by yshell -t into text, one
+//    line per record, on cout.
+//    Usage:  ytrace file...
+
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+#include "debug.h"
+#include "util.h"
+
+int main (int argc, char** argv) {
+   execname (argv[0]);
+   if (argc < 2) {
+      complain() << "usage: " << execname() << " file..." << endl;
+      return exit_status::get();
+   }
+   for (int arg = 1; arg < argc; ++arg) {
+      ifstream in (argv[arg], ios::binary);
+      if (not in) {
+         complain() << argv[arg] << ": cannot open" << endl;
+         continue;
+      }
+      if (not trace_ring::decode (in, cout)) {
+         complain() << argv[arg] << ": not a complete trace" << endl;
+      }
+   }
+   return exit_status::get();
+}